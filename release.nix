@@ -53,8 +53,10 @@ rec {
         export VARTEXFONTS=$TMPDIR/texfonts
 
         addToSearchPath PATH $(pwd)/src/script
+        addToSearchPath PATH $(pwd)/src/hydra-evaluator
         addToSearchPath PATH $(pwd)/src/hydra-eval-jobs
         addToSearchPath PATH $(pwd)/src/hydra-queue-runner
+        addToSearchPath PATH $(pwd)/src/hydra-update-gc-roots
         addToSearchPath PERL5LIB $(pwd)/src/lib
       '';
 
@@ -101,6 +103,7 @@ rec {
         name = "hydra-perl-deps";
         paths = with perlPackages;
           [ ModulePluggable
+            BSDResource
             CatalystActionREST
             CatalystAuthenticationStoreDBIxClass
             CatalystDevel
@@ -1,6 +1,13 @@
+#include <chrono>
 #include <map>
 #include <iostream>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <gc/gc.h>
 #include <gc/gc_allocator.h>
 
 #include "shared.hh"
@@ -12,6 +19,10 @@
 #include "get-drvs.hh"
 #include "common-opts.hh"
 #include "globals.hh"
+#include "misc.hh"
+#include "pathlocks.hh"
+
+#include "step-graph.hh"
 
 using namespace nix;
 
@@ -19,10 +30,54 @@ using namespace nix;
 static Path gcRootsDir;
 
 
+/* The derivations of the jobs we've found, used to produce the step
+   graph (if requested). */
+static PathSet jobDrvPaths;
+
+
 typedef std::list<Value *, traceable_allocator<Value *> > ValueList;
 typedef std::map<Symbol, ValueList> AutoArgs;
 
 
+/* Cache of the derivation paths of the derivations we've seen, keyed
+   by their attribute set, so that a job that is also a constituent of
+   an aggregate has its derivation path computed only once. The
+   cache is allocated with traceable_allocator so that the attribute
+   sets are not garbage-collected (and their addresses reused) while
+   they're in the cache. */
+typedef std::map<Bindings *, Path, std::less<Bindings *>,
+    traceable_allocator<std::pair<Bindings * const, Path> > > DrvPathCache;
+
+static DrvPathCache drvPathCache;
+
+
+static Path queryDrvPath(EvalState & state, Value & v)
+{
+    auto i = drvPathCache.find(v.attrs);
+    if (i != drvPathCache.end()) return i->second;
+    Bindings::iterator a = v.attrs->find(state.sDrvPath);
+    if (a == v.attrs->end())
+        throw EvalError("derivation must have a ‘drvPath’ attribute");
+    PathSet context;
+    Path drvPath = state.coerceToPath(*a->pos, *a->value, context);
+    drvPathCache[v.attrs] = drvPath;
+    return drvPath;
+}
+
+
+/* Add the derivations in the string context of ‘v’ to ‘drvs’. */
+static void getContextDrvs(EvalState & state, const Pos & pos, Value & v, PathSet & drvs)
+{
+    PathSet context;
+    state.coerceToString(pos, v, context, true, false);
+    for (auto & i : context)
+        if (i.at(0) == '!') {
+            size_t index = i.find("!", 1);
+            drvs.insert(string(i, index + 1));
+        }
+}
+
+
 static void findJobs(EvalState & state, JSONObject & top,
     const AutoArgs & argsLeft, Value & v, const string & attrPath);
 
@@ -121,7 +176,7 @@ static void findJobsWrapped(EvalState & state, JSONObject & top,
             JSONObject res(top.str);
             res.attr("nixName", drv.name);
             res.attr("system", drv.system);
-            res.attr("drvPath", drvPath = drv.queryDrvPath());
+            res.attr("drvPath", drvPath = queryDrvPath(state, v));
             res.attr("description", drv.queryMetaString("description"));
             res.attr("license", queryMetaStrings(state, drv, "license"));
             res.attr("homepage", drv.queryMetaString("homepage"));
@@ -131,23 +186,35 @@ static void findJobsWrapped(EvalState & state, JSONObject & top,
             res.attr("maxSilent", drv.queryMetaInt("maxSilent", 7200));
             res.attr("isChannel", drv.queryMetaBool("isHydraChannel", false));
 
-            /* If this is an aggregate, then get its constituents. */
+            /* If this is an aggregate, then get its constituents.
+               For a list of derivations, take their derivation paths
+               directly rather than coercing the whole list to a
+               string, which is expensive for large aggregates.
+               Anything else is coerced to a string, and the
+               derivations are taken from its context. */
             Bindings::iterator a = v.attrs->find(state.symbols.create("_hydraAggregate"));
             if (a != v.attrs->end() && state.forceBool(*a->value)) {
                 Bindings::iterator a = v.attrs->find(state.symbols.create("constituents"));
                 if (a == v.attrs->end())
                     throw EvalError("derivation must have a ‘constituents’ attribute");
-                PathSet context;
-                state.coerceToString(*a->pos, *a->value, context, true, false);
                 PathSet drvs;
-                for (auto & i : context)
-                    if (i.at(0) == '!') {
-                        size_t index = i.find("!", 1);
-                        drvs.insert(string(i, index + 1));
+                state.forceValue(*a->value);
+                if (a->value->isList()) {
+                    for (unsigned int n = 0; n < a->value->listSize(); ++n) {
+                        Value & c(*a->value->listElems()[n]);
+                        state.forceValue(c);
+                        if (state.isDerivation(c))
+                            drvs.insert(queryDrvPath(state, c));
+                        else
+                            getContextDrvs(state, *a->pos, c, drvs);
                     }
+                } else
+                    getContextDrvs(state, *a->pos, *a->value, drvs);
                 res.attr("constituents", concatStringsSep(" ", drvs));
             }
 
+            jobDrvPaths.insert(drvPath);
+
             /* Register the derivation as a GC root.  !!! This
                registers roots for jobs that we may have already
                done. */
@@ -207,6 +274,422 @@ static void findJobs(EvalState & state, JSONObject & top,
 }
 
 
+/* The arguments of an evaluation, as given on the command line or in
+   a request to the evaluation server. */
+struct EvalRequest
+{
+    Strings searchPath;
+    Path releaseExpr;
+    Path gcRootsDir;
+    Path stepGraphFile;
+    bool dryRun = false;
+    std::map<string, Strings> autoArgs;
+};
+
+
+static EvalRequest parseRequest(Strings args,
+    std::function<bool(Strings::iterator & arg, const Strings::iterator & end)> parseExtraArg)
+{
+    EvalRequest req;
+
+    args.push_front("hydra-eval-jobs");
+    auto argv = stringsToCharPtrs(args);
+
+    parseCmdLine(args.size(), argv.data(), [&](Strings::iterator & arg, const Strings::iterator & end) {
+        if (*arg == "--arg" || *arg == "--argstr") {
+            /* This is like --arg in nix-instantiate, except that it
+               supports multiple versions for the same argument.
+               That is, autoArgs is a mapping from variable names to
+               *lists* of values. */
+            auto what = *arg;
+            string name = getArg(what, arg, end);
+            string value = getArg(what, arg, end);
+            req.autoArgs[name].push_back((what == "--arg" ? 'E' : 'S') + value);
+        }
+        else if (parseSearchPathArg(arg, end, req.searchPath))
+            ;
+        else if (*arg == "--gc-roots-dir")
+            req.gcRootsDir = getArg(*arg, arg, end);
+        else if (*arg == "--step-graph")
+            req.stepGraphFile = getArg(*arg, arg, end);
+        else if (*arg == "--dry-run")
+            req.dryRun = true;
+        else if (parseExtraArg(arg, end))
+            ;
+        else if (*arg != "" && arg->at(0) == '-')
+            return false;
+        else
+            req.releaseExpr = absPath(*arg);
+        return true;
+    });
+
+    return req;
+}
+
+
+static void evaluate(EvalState & state, const EvalRequest & req, std::ostream & out)
+{
+    if (req.releaseExpr == "") throw UsageError("no expression specified");
+
+    gcRootsDir = req.gcRootsDir;
+    if (gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
+
+    jobDrvPaths.clear();
+    drvPathCache.clear();
+
+    AutoArgs autoArgs;
+    Value * inputsSet = state.allocValue();
+    state.mkAttrs(*inputsSet, req.autoArgs.size());
+    for (auto & i : req.autoArgs) {
+        Symbol inputName = state.symbols.create(i.first);
+        bool first = true;
+        for (auto & j : i.second) {
+            Value * v = state.allocValue();
+            if (j[0] == 'E')
+                state.eval(state.parseExprFromString(string(j, 1), absPath(".")), *v);
+            else
+                mkString(*v, string(j, 1));
+            autoArgs[inputName].push_back(v);
+            if (first) {
+                inputsSet->attrs->push_back(Attr(inputName, v));
+                first = false;
+            }
+        }
+    }
+    Symbol sInputs = state.symbols.create("inputs");
+    if (autoArgs.find(sInputs) == autoArgs.end()) {
+        inputsSet->attrs->sort();
+        autoArgs[sInputs].push_back(inputsSet);
+    }
+
+    Value v;
+    state.evalFile(req.releaseExpr, v);
+
+    {
+        JSONObject json(out);
+        findJobs(state, json, autoArgs, v, "");
+    }
+
+    /* Write the step graph of all jobs for the queue runner. */
+    if (req.stepGraphFile != "") {
+        if (settings.readOnlyMode)
+            printMsg(lvlError, "warning: not writing a step graph in dry-run mode");
+        else {
+            PathSet closure;
+            for (auto & drvPath : jobDrvPaths)
+                computeFSClosure(*store, drvPath, closure);
+            StepGraph graph;
+            for (auto & path : closure)
+                if (isDerivation(path))
+                    graph[path] = readDerivation(path);
+            writeStepGraph(req.stepGraphFile, graph);
+        }
+    }
+}
+
+
+/* Set by the SIGALRM handler when a request exceeds its deadline. It
+   also sets Nix's interrupt flag, so that the evaluation (or a blocked
+   read or write on the client socket) is aborted at the next
+   checkInterrupt(). */
+static volatile sig_atomic_t timedOut = 0;
+
+static void onDeadline(int)
+{
+    timedOut = 1;
+    _isInterrupted = 1;
+}
+
+
+/* Arm the deadline of a request, and disarm it when the request is
+   done. */
+struct Deadline
+{
+    Deadline(unsigned int seconds)
+    {
+        timedOut = 0;
+        _isInterrupted = 0;
+        alarm(seconds);
+    }
+
+    /* Note: ‘timedOut’ is left set, so that the caller can report
+       the timeout after the deadline is destroyed. */
+    ~Deadline()
+    {
+        alarm(0);
+        _isInterrupted = 0;
+    }
+};
+
+
+/* Redirect stderr to a temporary file while handling a request, so
+   that the warnings and traces printed by the evaluation can be
+   returned to the client. */
+struct CaptureStderr
+{
+    AutoCloseFD fd, savedFD;
+
+    CaptureStderr()
+    {
+        Path tmpl = getEnv("TMPDIR", "/tmp") + "/hydra-eval-jobs-stderr.XXXXXX";
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+        buf.push_back(0);
+        fd = mkstemp(buf.data());
+        if (fd == -1) throw SysError(format("creating temporary file ‘%1%’") % tmpl);
+        unlink(buf.data());
+        savedFD = dup(STDERR_FILENO);
+        if (savedFD == -1) throw SysError("duplicating stderr");
+        if (dup2(fd, STDERR_FILENO) == -1) throw SysError("redirecting stderr");
+    }
+
+    ~CaptureStderr()
+    {
+        if (savedFD != -1) dup2(savedFD, STDERR_FILENO);
+    }
+
+    /* Restore stderr and return what was written to it. */
+    string restore()
+    {
+        if (savedFD == -1) return "";
+        dup2(savedFD, STDERR_FILENO);
+        savedFD.close();
+        if (lseek(fd, 0, SEEK_SET) == -1) return "";
+        return drainFD(fd);
+    }
+};
+
+
+/* Server mode: keep an EvalState around across evaluation requests
+   received on a Unix domain socket, so that files that were parsed
+   and evaluated by a previous request (such as an unchanged Nixpkgs)
+   don't have to be parsed and evaluated again.
+
+   A request consists of the command line arguments of a normal
+   invocation, separated by NUL characters, optionally including
+   ‘--timeout <seconds>’; the client then shuts down its side of the
+   connection. The response is a line ‘ok <eval-ms> <saved-ms>
+   <stderr-bytes>’ followed by the evaluation's stderr and the JSON
+   job set, or a line ‘error <stderr-bytes>’ followed by the
+   evaluation's stderr and an error message. A request that takes
+   longer than its timeout (by default ‘defaultRequestTimeout’) is
+   aborted.
+
+   Requests are handled one at a time, since the EvalState is not
+   thread-safe: concurrent clients wait in the listen backlog until
+   the current evaluation is done. Clients should therefore allow for
+   the queueing time in their own deadline.
+
+   Cached files are keyed by content: files in the Nix store are
+   immutable, and the other files are hashed before every request, so
+   any change to them discards the cache. The server exits after a
+   request that leaves the GC heap larger than ‘maxHeapSize’; the
+   client then starts a new one. */
+static const unsigned int defaultRequestTimeout = 10800;
+
+static void runServer(const Path & socketPath, unsigned long maxHeapSize, unsigned long startupMs)
+{
+    /* Note: no SA_RESTART, so that blocking reads and writes are
+       interrupted when the deadline expires. */
+    struct sigaction act;
+    act.sa_handler = onDeadline;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGALRM, &act, 0))
+        throw SysError("installing handler for SIGALRM");
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path))
+        throw Error(format("socket path ‘%1%’ is too long") % socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    /* Several clients may start a server at the same time. The
+       servers serialise on ‘<socket>.lock’ while checking and binding
+       the socket, and only remove a socket that nobody is listening
+       on. A server that finds another one running exits. */
+    Path lockPath = socketPath + ".lock";
+    AutoCloseFD fdLock = openLockFile(lockPath, true);
+    lockFile(fdLock, ltWrite, true);
+
+    {
+        AutoCloseFD fdProbe = socket(PF_UNIX, SOCK_STREAM, 0);
+        if (fdProbe == -1) throw SysError("cannot create Unix domain socket");
+        if (connect(fdProbe, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            printMsg(lvlInfo, format("another server is listening on ‘%1%’, exiting") % socketPath);
+            return;
+        }
+        if (errno != ECONNREFUSED && errno != ENOENT)
+            throw SysError(format("cannot connect to socket ‘%1%’") % socketPath);
+    }
+
+    AutoCloseFD fdSocket = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fdSocket == -1) throw SysError("cannot create Unix domain socket");
+
+    /* The socket is stale. */
+    unlink(socketPath.c_str());
+
+    if (bind(fdSocket, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError(format("cannot bind to socket ‘%1%’") % socketPath);
+
+    if (listen(fdSocket, 5) == -1)
+        throw SysError(format("cannot listen on socket ‘%1%’") % socketPath);
+
+    lockFile(fdLock, ltNone, true);
+
+    std::shared_ptr<EvalState> state;
+    Strings stateSearchPath;
+    bool stateReadOnly = false;
+
+    /* Hashes of the non-store files that the cached evaluation
+       results depend on. */
+    std::map<Path, Hash> fileHashes;
+
+    /* Duration of the first (cold) evaluation of each release
+       expression, keyed by its path with store hashes stripped. */
+    std::map<string, unsigned long> coldEvalMs;
+
+    while (true) {
+        AutoCloseFD remote = accept(fdSocket, 0, 0);
+        if (remote == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("accepting connection");
+        }
+
+        string response;
+        unsigned int timeout = defaultRequestTimeout;
+        std::shared_ptr<CaptureStderr> capture;
+
+        try {
+            Deadline deadline(timeout);
+
+            capture = std::make_shared<CaptureStderr>();
+
+            auto args = tokenizeString<Strings>(drainFD(remote), string(1, '\0'));
+
+            /* A connection without a request is a probe by a
+               starting server. */
+            if (args.empty()) continue;
+
+            auto req = parseRequest(args, [&](Strings::iterator & arg, const Strings::iterator & end) {
+                if (*arg != "--timeout") return false;
+                if (!string2Int(getArg(*arg, arg, end), timeout) || timeout == 0)
+                    throw UsageError("`--timeout' requires a positive number of seconds");
+                return true;
+            });
+
+            alarm(timeout);
+
+            settings.readOnlyMode = req.dryRun;
+
+            /* Discard the cached evaluation state if it was created
+               with different settings. In particular, derivations
+               instantiated in dry-run mode are not in the store. */
+            if (state && (stateSearchPath != req.searchPath || stateReadOnly != req.dryRun)) {
+                printMsg(lvlInfo, "discarding evaluation state");
+                state.reset();
+            }
+
+            /* Discard the cached files if any of the inputs outside
+               of the Nix store have changed. */
+            Paths inputs = {req.releaseExpr};
+            for (auto & i : req.searchPath) {
+                auto eq = i.find('=');
+                inputs.push_back(eq == string::npos ? i : string(i, eq + 1));
+            }
+            for (auto & path : inputs) {
+                if (isInStore(path) || !pathExists(path)) continue;
+                Hash hash = hashPath(htSHA256, path).first;
+                auto i = fileHashes.find(path);
+                if (i != fileHashes.end() && i->second != hash && state) {
+                    printMsg(lvlInfo, format("‘%1%’ has changed, discarding cached files") % path);
+                    state->resetFileCache();
+                }
+                fileHashes[path] = hash;
+            }
+
+            if (!state) {
+                state = std::make_shared<EvalState>(req.searchPath);
+                stateSearchPath = req.searchPath;
+                stateReadOnly = req.dryRun;
+            }
+
+            auto startTime = std::chrono::steady_clock::now();
+
+            std::ostringstream out;
+            evaluate(*state, req, out);
+
+            /* If the garbage collector has deleted any of the
+               derivations we cached, evaluate again from scratch. */
+            bool stale = false;
+            if (!req.dryRun)
+                for (auto & drvPath : jobDrvPaths)
+                    if (!store->isValidPath(drvPath)) stale = true;
+            if (stale) {
+                printMsg(lvlInfo, "cached derivations have been garbage-collected, evaluating again");
+                state->resetFileCache();
+                out.str("");
+                evaluate(*state, req, out);
+            }
+
+            unsigned long evalMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+
+            string key = req.releaseExpr;
+            if (isInStore(key)) key = string(key, settings.nixStore.size() + 1 + 33);
+            auto cold = coldEvalMs.find(key);
+            unsigned long savedMs = startupMs;
+            if (cold == coldEvalMs.end())
+                coldEvalMs[key] = evalMs;
+            else if (cold->second > evalMs)
+                savedMs += cold->second - evalMs;
+
+            string evalStderr = capture->restore();
+
+            printMsg(lvlInfo, format("evaluated ‘%1%’ in %2% ms, saving an estimated %3% ms")
+                % req.releaseExpr % evalMs % savedMs);
+
+            writeFull(remote, (format("ok %1% %2% %3%\n") % evalMs % savedMs % evalStderr.size()).str());
+            writeFull(remote, evalStderr);
+            writeFull(remote, out.str());
+
+        } catch (std::exception & e) {
+            string msg = timedOut
+                ? (format("evaluation timed out after %1% seconds") % timeout).str()
+                : e.what();
+            string evalStderr;
+            try {
+                if (capture) evalStderr = capture->restore();
+            } catch (...) { }
+            printMsg(lvlError, format("evaluation request failed: %1%") % msg);
+
+            /* An interrupted evaluation can leave thunks in the
+               blackholed state, so the evaluation state can't be
+               reused. */
+            if (timedOut || dynamic_cast<Interrupted *>(&e)) state.reset();
+
+            /* Note: if the client has stopped reading, this fails
+               once it gives up and closes the connection. */
+            try {
+                writeFull(remote, (format("error %1%\n") % evalStderr.size()).str());
+                writeFull(remote, evalStderr);
+                writeFull(remote, msg);
+            } catch (...) { }
+        }
+
+        remote.close();
+
+        size_t heapSize = GC_get_heap_size();
+        if (heapSize > maxHeapSize) {
+            printMsg(lvlInfo, format("heap size is %1% MiB, exiting") % (heapSize / (1024 * 1024)));
+            break;
+        }
+    }
+
+    lockFile(fdLock, ltWrite, true);
+    unlink(socketPath.c_str());
+}
+
+
 int main(int argc, char * * argv)
 {
     /* Prevent undeclared dependencies in the evaluation via
@@ -214,34 +697,25 @@ int main(int argc, char * * argv)
     unsetenv("NIX_PATH");
 
     return handleExceptions(argv[0], [&]() {
+        auto startTime = std::chrono::steady_clock::now();
+
         initNix();
         initGC();
 
-        Strings searchPath;
-        Path releaseExpr;
-        std::map<string, Strings> autoArgs_;
-
-        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
-            if (*arg == "--arg" || *arg == "--argstr") {
-                /* This is like --arg in nix-instantiate, except that it
-                   supports multiple versions for the same argument.
-                   That is, autoArgs is a mapping from variable names to
-                   *lists* of values. */
-                auto what = *arg;
-                string name = getArg(what, arg, end);
-                string value = getArg(what, arg, end);
-                autoArgs_[name].push_back((what == "--arg" ? 'E' : 'S') + value);
-            }
-            else if (parseSearchPathArg(arg, end, searchPath))
-                ;
-            else if (*arg == "--gc-roots-dir")
-                gcRootsDir = getArg(*arg, arg, end);
-            else if (*arg == "--dry-run")
-                settings.readOnlyMode = true;
-            else if (*arg != "" && arg->at(0) == '-')
+        Path socketPath;
+        unsigned long maxHeapSize = 4096;
+
+        Strings args = argvToStrings(argc, argv);
+        args.pop_front();
+
+        auto req = parseRequest(args, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--server")
+                socketPath = getArg(*arg, arg, end);
+            else if (*arg == "--max-heap-size") {
+                if (!string2Int(getArg(*arg, arg, end), maxHeapSize))
+                    throw UsageError("`--max-heap-size' requires a size in MiB");
+            } else
                 return false;
-            else
-                releaseExpr = absPath(*arg);
             return true;
         });
 
@@ -249,44 +723,28 @@ int main(int argc, char * * argv)
            to the environment. */
         settings.set("restrict-eval", "true");
 
-        if (releaseExpr == "") throw UsageError("no expression specified");
-
-        if (gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
-
-        EvalState state(searchPath);
-
-        AutoArgs autoArgs;
-        Value * inputsSet = state.allocValue();
-        state.mkAttrs(*inputsSet, autoArgs_.size());
-        for (auto & i : autoArgs_) {
-            Symbol inputName = state.symbols.create(i.first);
-            bool first = true;
-            for (auto & j : i.second) {
-                Value * v = state.allocValue();
-                if (j[0] == 'E')
-                    state.eval(state.parseExprFromString(string(j, 1), absPath(".")), *v);
-                else
-                    mkString(*v, string(j, 1));
-                autoArgs[inputName].push_back(v);
-                if (first) {
-                    inputsSet->attrs->push_back(Attr(inputName, v));
-                    first = false;
-                }
+        if (socketPath != "") {
+            store = openStore();
+
+            /* Estimate the startup cost of a one-shot evaluator. */
+            unsigned long startupMs;
+            {
+                EvalState state(req.searchPath);
+                startupMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - startTime).count();
             }
-        }
-        Symbol sInputs = state.symbols.create("inputs");
-        if (autoArgs.find(sInputs) == autoArgs.end()) {
-            inputsSet->attrs->sort();
-            autoArgs[sInputs].push_back(inputsSet);
+
+            runServer(socketPath, maxHeapSize * 1024 * 1024, startupMs);
+            return;
         }
 
-        store = openStore();
+        settings.readOnlyMode = req.dryRun;
 
-        Value v;
-        state.evalFile(releaseExpr, v);
+        EvalState state(req.searchPath);
 
-        JSONObject json(std::cout);
-        findJobs(state, json, autoArgs, v, "");
+        store = openStore();
+
+        evaluate(state, req, std::cout);
 
         state.printStats();
     });
@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <limits>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "db.hh"
+#include "hydra-config.hh"
+#include "sync.hh"
+
+#include "shared.hh"
+#include "value-to-json.hh"
+
+using namespace nix;
+
+
+typedef std::pair<std::string, std::string> JobsetName;
+
+
+static const time_t notTriggered = std::numeric_limits<time_t>::max();
+
+
+/* The evaluator daemon. It polls the Jobsets table and runs up to
+   ‘max_concurrent_evals’ instances of hydra-eval-jobset at the same
+   time. Jobsets that were triggered (e.g. by a push) go first, in
+   order of their trigger time; then jobsets whose check interval
+   has expired, most overdue first. */
+struct Evaluator
+{
+    std::map<std::string, std::string> hydraConfig;
+
+    /* The maximum number of concurrent evaluations. */
+    size_t maxEvals = 4;
+
+    /* The memory (in MiB) that concurrent evaluations may use in
+       total, or 0 for no limit. Each evaluation is assumed to need as
+       much memory as the previous evaluation of the same jobset, or
+       ‘defaultEvalMemory’ if it hasn't been evaluated yet. The
+       first evaluation is always allowed to start, even if its
+       estimate exceeds the limit. */
+    size_t maxMemory = 0;
+    size_t defaultEvalMemory = 1024;
+
+    /* How often to poll the Jobsets table. */
+    unsigned int pollInterval = 10;
+
+    struct Jobset
+    {
+        JobsetName name;
+        time_t lastCheckedTime = 0, triggerTime = notTriggered;
+        int checkInterval = 0;
+        bool enabled = false;
+
+        pid_t pid = -1;
+        time_t evalStart = 0;
+        size_t memory = 0; // estimate for the running evaluation
+
+        /* The peak memory (in MiB) of the previous evaluation. */
+        size_t peakMemory = 0;
+
+        /* Statistics. The queue delay is the time between a jobset
+           becoming due for evaluation and its evaluation starting. */
+        unsigned int nrEvals = 0, nrFailedEvals = 0;
+        time_t lastQueueDelay = 0, maxQueueDelay = 0, totalQueueDelay = 0;
+        time_t lastEvalTime = 0;
+    };
+
+    typedef std::map<JobsetName, Jobset> Jobsets;
+
+    struct State
+    {
+        Jobsets jobsets;
+        size_t runningEvals = 0;
+        size_t memoryInUse = 0;
+        /* Set when an evaluation has finished. */
+        bool evalFinished = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable_any childStarted;
+    std::condition_variable_any maybeDoWork;
+
+    time_t startedAt;
+
+    Evaluator()
+    {
+        hydraConfig = getHydraConfig();
+
+        if (hydraConfig["max_concurrent_evals"] != "")
+            string2Int(hydraConfig["max_concurrent_evals"], maxEvals);
+        if (maxEvals < 1) maxEvals = 1;
+
+        /* The evaluation server handles one request at a time, and
+           its memory is not included in the resource usage of the
+           evaluations that use it, since it's not our descendant. So
+           with concurrent evaluations, let every hydra-eval-jobset
+           run its own hydra-eval-jobs instead. */
+        if (maxEvals > 1 && hydraConfig["eval_server_socket"] != "") {
+            printMsg(lvlError, "ignoring ‘eval_server_socket’ because ‘max_concurrent_evals’ is greater than 1");
+            setenv("HYDRA_NO_EVAL_SERVER", "1", 1);
+        }
+
+        if (hydraConfig["evaluator_max_memory_size"] != "")
+            string2Int(hydraConfig["evaluator_max_memory_size"], maxMemory);
+
+        if (hydraConfig["evaluator_default_memory_size"] != "")
+            string2Int(hydraConfig["evaluator_default_memory_size"], defaultEvalMemory);
+
+        if (hydraConfig["evaluator_poll_interval"] != "")
+            string2Int(hydraConfig["evaluator_poll_interval"], pollInterval);
+        if (pollInterval < 1) pollInterval = 1;
+    }
+
+    void readJobsets(Connection & conn)
+    {
+        pqxx::work txn(conn);
+
+        auto res = txn.exec
+            ("select project, j.name, lastCheckedTime, triggerTime, checkInterval, "
+             "j.enabled != 0 and p.enabled = 1 as enabled "
+             "from Jobsets j join Projects p on j.project = p.name");
+
+        auto state(state_.lock());
+
+        std::set<JobsetName> seen;
+
+        for (auto const & row : res) {
+            auto name = JobsetName{row["project"].as<std::string>(), row["name"].as<std::string>()};
+
+            auto i = state->jobsets.find(name);
+            if (i == state->jobsets.end())
+                i = state->jobsets.emplace(name, Jobset()).first;
+
+            auto & jobset(i->second);
+            jobset.name = name;
+            jobset.lastCheckedTime = row["lastCheckedTime"].as<time_t>(0);
+            jobset.triggerTime = row["triggerTime"].as<time_t>(notTriggered);
+            jobset.checkInterval = row["checkInterval"].as<int>();
+            jobset.enabled = row["enabled"].as<bool>();
+
+            seen.insert(name);
+        }
+
+        for (auto i = state->jobsets.begin(); i != state->jobsets.end(); )
+            if (seen.find(i->first) == seen.end() && i->second.pid == -1)
+                i = state->jobsets.erase(i);
+            else
+                ++i;
+    }
+
+    /* Return the time at which the jobset became due for
+       evaluation, or notTriggered if it isn't due. */
+    time_t dueTime(const Jobset & jobset, time_t now)
+    {
+        if (jobset.triggerTime != notTriggered)
+            return jobset.triggerTime;
+
+        if (!jobset.enabled || jobset.checkInterval <= 0)
+            return notTriggered;
+
+        time_t due = jobset.lastCheckedTime + jobset.checkInterval;
+        return due <= now ? due : notTriggered;
+    }
+
+    void startEval(State & state, Jobset & jobset, time_t now)
+    {
+        time_t due = dueTime(jobset, now);
+
+        printMsg(lvlInfo, format("starting evaluation of jobset ‘%1%:%2%’ (%3%)")
+            % jobset.name.first % jobset.name.second
+            % (jobset.lastCheckedTime
+                ? (format("last checked %1%s ago") % (now - jobset.lastCheckedTime)).str()
+                : "never checked"));
+
+        jobset.pid = startProcess([&]() {
+            execlp("hydra-eval-jobset", "hydra-eval-jobset",
+                jobset.name.first.c_str(), jobset.name.second.c_str(), nullptr);
+            throw SysError("cannot start hydra-eval-jobset");
+        });
+
+        jobset.evalStart = now;
+        jobset.memory = jobset.peakMemory ? jobset.peakMemory : defaultEvalMemory;
+
+        /* A jobset that was never checked has no meaningful due
+           time. */
+        time_t delay = jobset.lastCheckedTime || jobset.triggerTime != notTriggered ? std::max(now - due, (time_t) 0) : 0;
+        jobset.nrEvals++;
+        jobset.lastQueueDelay = delay;
+        jobset.totalQueueDelay += delay;
+        jobset.maxQueueDelay = std::max(jobset.maxQueueDelay, delay);
+
+        state.runningEvals++;
+        state.memoryInUse += jobset.memory;
+
+        childStarted.notify_one();
+    }
+
+    void startEvals(State & state)
+    {
+        time_t now = time(0);
+
+        std::vector<Jobsets::iterator> sorted;
+
+        for (auto i = state.jobsets.begin(); i != state.jobsets.end(); ++i)
+            if (i->second.pid == -1 && dueTime(i->second, now) != notTriggered)
+                sorted.push_back(i);
+
+        sort(sorted.begin(), sorted.end(),
+            [&](const Jobsets::iterator & a, const Jobsets::iterator & b) {
+                bool ta = a->second.triggerTime != notTriggered;
+                bool tb = b->second.triggerTime != notTriggered;
+                return
+                    ta != tb ? ta :
+                    ta ? a->second.triggerTime < b->second.triggerTime :
+                    dueTime(a->second, now) != dueTime(b->second, now) ? dueTime(a->second, now) < dueTime(b->second, now) :
+                    a->first < b->first;
+            });
+
+        for (auto & i : sorted) {
+            if (state.runningEvals >= maxEvals) break;
+
+            /* Don't let smaller jobsets overtake a jobset that
+               doesn't fit in the memory budget, since that could
+               starve it. */
+            size_t memory = i->second.peakMemory ? i->second.peakMemory : defaultEvalMemory;
+            if (maxMemory && state.runningEvals && state.memoryInUse + memory > maxMemory) break;
+
+            startEval(state, i->second, now);
+        }
+    }
+
+    void loop()
+    {
+        Connection conn;
+
+        while (true) {
+            try {
+                readJobsets(conn);
+
+                {
+                    auto state(state_.lock());
+                    startEvals(*state);
+                }
+
+                writeStatus(conn);
+
+                auto state(state_.lock());
+                state.wait_for(maybeDoWork, std::chrono::seconds(pollInterval),
+                    [&]() { return state->evalFinished; });
+                state->evalFinished = false;
+
+            } catch (std::exception & e) {
+                printMsg(lvlError, format("evaluator: %1%") % e.what());
+                sleep(5);
+            }
+        }
+    }
+
+    /* Wait for evaluations to finish, and record their results. */
+    void reaper()
+    {
+        Connection conn;
+
+        while (true) {
+
+            {
+                auto state(state_.lock());
+                while (!state->runningEvals)
+                    state.wait(childStarted);
+            }
+
+            int status;
+            struct rusage ru;
+            pid_t pid = wait4(-1, &status, 0, &ru);
+            if (pid == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for children");
+            }
+
+            JobsetName name;
+            time_t evalStart;
+
+            {
+                auto state(state_.lock());
+
+                auto i = std::find_if(state->jobsets.begin(), state->jobsets.end(),
+                    [&](const Jobsets::value_type & j) { return j.second.pid == pid; });
+                if (i == state->jobsets.end()) continue;
+
+                auto & jobset(i->second);
+                name = jobset.name;
+                evalStart = jobset.evalStart;
+
+                /* ru_maxrss is the peak resident set size of the
+                   largest process in the child's subtree, i.e. of
+                   hydra-eval-jobs. */
+                jobset.peakMemory = std::max((size_t) ru.ru_maxrss / 1024, (size_t) 1);
+                jobset.lastEvalTime = time(0) - evalStart;
+                if (status != 0) jobset.nrFailedEvals++;
+                jobset.pid = -1;
+
+                state->runningEvals--;
+                state->memoryInUse -= jobset.memory;
+                jobset.memory = 0;
+
+                state->evalFinished = true;
+            }
+
+            printMsg(lvlInfo, format("evaluation of jobset ‘%1%:%2%’ %3% after %4%s")
+                % name.first % name.second % statusToString(status) % (time(0) - evalStart));
+
+            /* hydra-eval-jobset exits with status 1 after recording an
+               evaluation error itself. If it died otherwise (e.g. it
+               was killed because it ran out of memory), record the
+               error here, and clear the trigger time so that the
+               jobset doesn't get stuck in a loop of failing
+               evaluations. */
+            if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 1)) {
+                try {
+                    pqxx::work txn(conn);
+                    txn.parameterized
+                        ("update Jobsets set lastCheckedTime = $1, errorMsg = $2, errorTime = $1, "
+                         "triggerTime = case when triggerTime <= $5 then null else triggerTime end "
+                         "where project = $3 and name = $4")
+                        (time(0))
+                        ("evaluation " + statusToString(status))
+                        (name.first)(name.second)
+                        (evalStart).exec();
+                    txn.commit();
+                } catch (std::exception & e) {
+                    printMsg(lvlError, format("cannot record evaluation failure: %1%") % e.what());
+                }
+            }
+
+            maybeDoWork.notify_one();
+        }
+    }
+
+    void writeStatus(Connection & conn)
+    {
+        std::ostringstream out;
+
+        {
+            JSONObject root(out);
+            time_t now = time(0);
+            root.attr("status", "up");
+            root.attr("time", now);
+            root.attr("uptime", now - startedAt);
+            root.attr("pid", getpid());
+            root.attr("maxEvals", maxEvals);
+            root.attr("maxMemory", maxMemory);
+
+            auto state(state_.lock());
+
+            root.attr("runningEvals", state->runningEvals);
+            root.attr("memoryInUse", state->memoryInUse);
+
+            size_t nrQueued = 0;
+            for (auto & i : state->jobsets)
+                if (i.second.pid == -1 && dueTime(i.second, now) != notTriggered) nrQueued++;
+            root.attr("queuedEvals", nrQueued);
+
+            root.attr("jobsets");
+            JSONObject nested(out);
+            for (auto & i : state->jobsets) {
+                auto & jobset(i.second);
+                if (!jobset.nrEvals && jobset.pid == -1) continue;
+                nested.attr(i.first.first + ":" + i.first.second);
+                JSONObject nested2(out);
+                if (jobset.pid != -1) {
+                    nested2.attr("running", true);
+                    nested2.attr("evalStart", jobset.evalStart);
+                }
+                nested2.attr("nrEvals", jobset.nrEvals);
+                nested2.attr("nrFailedEvals", jobset.nrFailedEvals);
+                nested2.attr("lastQueueDelay", jobset.lastQueueDelay);
+                nested2.attr("maxQueueDelay", jobset.maxQueueDelay);
+                if (jobset.nrEvals) {
+                    nested2.attr("avgQueueDelay"); out << (float) jobset.totalQueueDelay / jobset.nrEvals;
+                }
+                nested2.attr("lastEvalTime", jobset.lastEvalTime);
+                nested2.attr("peakMemory", jobset.peakMemory);
+            }
+        }
+
+        pqxx::work txn(conn);
+        txn.exec("delete from SystemStatus where what = 'evaluator'");
+        txn.parameterized("insert into SystemStatus values ('evaluator', $1)")(out.str()).exec();
+        txn.commit();
+    }
+
+    void showStatus()
+    {
+        Connection conn;
+        pqxx::work txn(conn);
+        auto res = txn.exec("select status from SystemStatus where what = 'evaluator'");
+        std::cout << (res.size() ? res[0][0].as<std::string>() : R"({"status":"down"})") << "\n";
+    }
+
+    void run()
+    {
+        startedAt = time(0);
+
+        printMsg(lvlInfo, format("running up to %1% evaluations concurrently") % maxEvals);
+
+        std::thread([&]() {
+            while (true) {
+                try {
+                    reaper();
+                } catch (std::exception & e) {
+                    printMsg(lvlError, format("reaper: %1%") % e.what());
+                    sleep(5);
+                }
+            }
+        }).detach();
+
+        loop();
+    }
+};
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+
+        bool status = false;
+
+        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--status")
+                status = true;
+            else
+                return false;
+            return true;
+        });
+
+        Evaluator evaluator;
+        if (status)
+            evaluator.showStatus();
+        else
+            evaluator.run();
+    });
+}
@@ -0,0 +1,553 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#include "db.hh"
+
+#include "shared.hh"
+
+using namespace nix;
+
+
+typedef unsigned int BuildID;
+
+
+/* A parsed JSON value. This is just enough JSON for reading the
+   output of hydra-eval-jobs. */
+struct JSONValue
+{
+    enum Type { tNull, tBool, tNumber, tString, tArray, tObject } type = tNull;
+    bool boolean = false;
+    std::string string; // also the text of a number
+    std::vector<JSONValue> array;
+    std::map<std::string, JSONValue> object;
+
+    const JSONValue * get(const std::string & name) const
+    {
+        auto i = object.find(name);
+        return i == object.end() ? 0 : &i->second;
+    }
+
+    /* Return the attribute ‘name’ as a string, or ‘def’ if it
+       doesn't exist or is null. */
+    std::string getString(const std::string & name, const std::string & def = "") const
+    {
+        auto v = get(name);
+        if (!v || v->type == tNull) return def;
+        if (v->type == tBool) return v->boolean ? "1" : "0";
+        return v->string;
+    }
+};
+
+
+class JSONParser
+{
+    const std::string & s;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string & msg)
+    {
+        throw Error(format("JSON parse error at offset %1%: %2%") % pos % msg);
+    }
+
+    void skipWhitespace()
+    {
+        while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\n' || s[pos] == '\r')) pos++;
+    }
+
+    void expect(char c)
+    {
+        skipWhitespace();
+        if (pos >= s.size() || s[pos] != c) fail((format("expected ‘%1%’") % c).str());
+        pos++;
+    }
+
+    void literal(const char * word)
+    {
+        size_t len = strlen(word);
+        if (s.compare(pos, len, word) != 0) fail("invalid literal");
+        pos += len;
+    }
+
+    static void encodeUTF8(std::string & out, unsigned int c)
+    {
+        if (c < 0x80) out += (char) c;
+        else if (c < 0x800) {
+            out += (char) (0xc0 | (c >> 6));
+            out += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            out += (char) (0xe0 | (c >> 12));
+            out += (char) (0x80 | ((c >> 6) & 0x3f));
+            out += (char) (0x80 | (c & 0x3f));
+        } else {
+            out += (char) (0xf0 | (c >> 18));
+            out += (char) (0x80 | ((c >> 12) & 0x3f));
+            out += (char) (0x80 | ((c >> 6) & 0x3f));
+            out += (char) (0x80 | (c & 0x3f));
+        }
+    }
+
+    unsigned int parseHex4()
+    {
+        if (pos + 4 > s.size()) fail("truncated \\u escape");
+        unsigned int c = 0;
+        for (int n = 0; n < 4; n++) {
+            char d = s[pos++];
+            c <<= 4;
+            if (d >= '0' && d <= '9') c |= d - '0';
+            else if (d >= 'a' && d <= 'f') c |= d - 'a' + 10;
+            else if (d >= 'A' && d <= 'F') c |= d - 'A' + 10;
+            else fail("invalid \\u escape");
+        }
+        return c;
+    }
+
+    std::string parseString()
+    {
+        expect('"');
+        std::string res;
+        while (true) {
+            if (pos >= s.size()) fail("unterminated string");
+            char c = s[pos++];
+            if (c == '"') break;
+            if (c != '\\') { res += c; continue; }
+            if (pos >= s.size()) fail("unterminated string");
+            c = s[pos++];
+            switch (c) {
+                case '"': case '\\': case '/': res += c; break;
+                case 'b': res += '\b'; break;
+                case 'f': res += '\f'; break;
+                case 'n': res += '\n'; break;
+                case 'r': res += '\r'; break;
+                case 't': res += '\t'; break;
+                case 'u': {
+                    unsigned int cp = parseHex4();
+                    /* A high surrogate must be followed by a low
+                       one. */
+                    if (cp >= 0xd800 && cp < 0xdc00) {
+                        if (s.compare(pos, 2, "\\u") != 0) fail("unpaired surrogate");
+                        pos += 2;
+                        unsigned int lo = parseHex4();
+                        if (lo < 0xdc00 || lo >= 0xe000) fail("invalid low surrogate");
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    } else if (cp >= 0xdc00 && cp < 0xe000)
+                        fail("unpaired surrogate");
+                    encodeUTF8(res, cp);
+                    break;
+                }
+                default: fail("invalid escape");
+            }
+        }
+        return res;
+    }
+
+    void parseValue(JSONValue & v)
+    {
+        skipWhitespace();
+        if (pos >= s.size()) fail("unexpected end of input");
+        char c = s[pos];
+
+        if (c == '{') {
+            v.type = JSONValue::tObject;
+            pos++;
+            skipWhitespace();
+            if (pos < s.size() && s[pos] == '}') { pos++; return; }
+            while (true) {
+                auto name = parseString();
+                expect(':');
+                parseValue(v.object[name]);
+                skipWhitespace();
+                if (pos < s.size() && s[pos] == ',') { pos++; continue; }
+                expect('}');
+                return;
+            }
+        }
+
+        else if (c == '[') {
+            v.type = JSONValue::tArray;
+            pos++;
+            skipWhitespace();
+            if (pos < s.size() && s[pos] == ']') { pos++; return; }
+            while (true) {
+                v.array.emplace_back();
+                parseValue(v.array.back());
+                skipWhitespace();
+                if (pos < s.size() && s[pos] == ',') { pos++; continue; }
+                expect(']');
+                return;
+            }
+        }
+
+        else if (c == '"') {
+            v.type = JSONValue::tString;
+            v.string = parseString();
+        }
+
+        else if (c == 't') { literal("true"); v.type = JSONValue::tBool; v.boolean = true; }
+        else if (c == 'f') { literal("false"); v.type = JSONValue::tBool; v.boolean = false; }
+        else if (c == 'n') { literal("null"); v.type = JSONValue::tNull; }
+
+        else if (c == '-' || (c >= '0' && c <= '9')) {
+            size_t start = pos++;
+            while (pos < s.size() && strchr("0123456789.eE+-", s[pos])) pos++;
+            v.type = JSONValue::tNumber;
+            v.string = std::string(s, start, pos - start);
+        }
+
+        else fail("unexpected character");
+    }
+
+public:
+
+    JSONParser(const std::string & s) : s(s) { }
+
+    JSONValue parse()
+    {
+        JSONValue v;
+        parseValue(v);
+        skipWhitespace();
+        if (pos != s.size()) fail("trailing garbage");
+        return v;
+    }
+};
+
+
+/* Write rows to a table using COPY. Fields equal to ‘null’ are
+   written as SQL NULL. */
+static const std::string null(1, '\0');
+
+typedef std::vector<std::string> Row;
+
+static void copyRows(pqxx::work & txn, const std::string & table,
+    const std::vector<std::string> & columns, const std::vector<Row> & rows)
+{
+    if (rows.empty()) return;
+    pqxx::tablewriter writer(txn, table, columns.begin(), columns.end(), null);
+    for (auto & row : rows) writer << row;
+    writer.complete();
+}
+
+
+static std::string nullIfEmpty(const std::string & s)
+{
+    return s == "" ? null : s;
+}
+
+
+struct Job
+{
+    std::string name;
+    const JSONValue * info;
+    std::string firstOutputName, firstOutputPath;
+    BuildID id = 0;
+    bool isNew = false;
+};
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        std::string projectName, jobsetName, hash, inputsFile, stepGraphFile, jobsFile;
+        unsigned int checkoutTime = 0, evalTime = 0;
+
+        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--project")
+                projectName = getArg(*arg, arg, end);
+            else if (*arg == "--jobset")
+                jobsetName = getArg(*arg, arg, end);
+            else if (*arg == "--hash")
+                hash = getArg(*arg, arg, end);
+            else if (*arg == "--inputs")
+                inputsFile = getArg(*arg, arg, end);
+            else if (*arg == "--step-graph")
+                stepGraphFile = getArg(*arg, arg, end);
+            else if (*arg == "--checkout-time") {
+                if (!string2Int(getArg(*arg, arg, end), checkoutTime))
+                    throw UsageError("‘--checkout-time’ requires an integer argument");
+            } else if (*arg == "--eval-time") {
+                if (!string2Int(getArg(*arg, arg, end), evalTime))
+                    throw UsageError("‘--eval-time’ requires an integer argument");
+            } else if (*arg != "" && arg->at(0) == '-')
+                return false;
+            else
+                jobsFile = *arg;
+            return true;
+        });
+
+        if (projectName == "" || jobsetName == "" || hash == "" || jobsFile == "")
+            throw UsageError("syntax: hydra-import-eval --project <PROJECT> --jobset <JOBSET> --hash <HASH> "
+                "[--inputs <FILE>] [--step-graph <FILE>] [--checkout-time <N>] [--eval-time <N>] <JOBS-FILE>");
+
+        auto jobsJSON = JSONParser(readFile(jobsFile)).parse();
+        if (jobsJSON.type != JSONValue::tObject)
+            throw Error(format("‘%1%’ does not contain a JSON object") % jobsFile);
+
+        JSONValue inputsJSON;
+        if (inputsFile != "")
+            inputsJSON = JSONParser(readFile(inputsFile)).parse();
+
+        /* Collect the jobs that evaluated successfully. */
+        std::vector<Job> jobs;
+        for (auto & i : jobsJSON.object) {
+            if (i.second.get("error")) continue;
+            auto outputs = i.second.get("outputs");
+            if (!outputs || outputs->type != JSONValue::tObject || outputs->object.empty())
+                throw Error(format("job ‘%1%’ has no outputs") % i.first);
+            Job job;
+            job.name = i.first;
+            job.info = &i.second;
+            /* In various checks we can use an arbitrary output (the
+               first) rather than all outputs, since if one output is
+               the same, the others will be as well. */
+            job.firstOutputName = outputs->object.begin()->first;
+            job.firstOutputPath = outputs->object.begin()->second.string;
+            jobs.push_back(job);
+        }
+
+        /* Add the new builds in random order. The queue runner
+           processes builds in order of ID, so this prevents it from
+           always doing the same jobs (e.g. the first ones in
+           alphabetical order) first. */
+        std::shuffle(jobs.begin(), jobs.end(), std::mt19937(std::random_device()()));
+
+        Connection conn;
+        pqxx::work txn(conn);
+
+        auto res = txn.parameterized
+            ("select nixExprInput, nixExprPath from Jobsets where project = $1 and name = $2")
+            (projectName)(jobsetName).exec();
+        if (res.empty())
+            throw Error(format("jobset ‘%1%:%2%’ does not exist") % projectName % jobsetName);
+        auto nixExprInput = res[0]["nixExprInput"].as<std::string>();
+        auto nixExprPath = res[0]["nixExprPath"].as<std::string>();
+
+        /* Get the most recent evaluation of the jobset that had new
+           builds. */
+        res = txn.parameterized
+            ("select id from JobsetEvals where project = $1 and jobset = $2 and hasNewBuilds = 1 "
+             "order by id desc limit 1")
+            (projectName)(jobsetName).exec();
+        unsigned int prevEval = res.empty() ? 0 : res[0][0].as<unsigned int>();
+
+        /* Clear the "current" flag on all builds. Since we're in a
+           transaction this will only become visible after the new
+           current builds have been added. */
+        txn.parameterized
+            ("update Builds set isCurrent = 0 where project = $1 and jobset = $2 and isCurrent = 1")
+            (projectName)(jobsetName).exec();
+
+        /* Make sure all jobs exist. */
+        txn.exec("create temporary table ImportJobs (name text not null) on commit drop");
+        {
+            std::vector<Row> rows;
+            for (auto & job : jobs) rows.push_back({job.name});
+            copyRows(txn, "ImportJobs", {"name"}, rows);
+        }
+        txn.parameterized
+            ("insert into Jobs (project, jobset, name) select $1, $2, name from ImportJobs i "
+             "where not exists (select 1 from Jobs j where j.project = $1 and j.jobset = $2 and j.name = i.name)")
+            (projectName)(jobsetName).exec();
+
+        /* Don't add a build that has already been scheduled for this
+           job in the previous evaluation, i.e. has the same
+           (job, output path). Get all of them in one query. */
+        size_t nrPrevMembers = 0;
+        if (prevEval) {
+            std::map<std::pair<std::string, std::string>, BuildID> prevBuilds;
+            res = txn.parameterized
+                ("select b.id, b.job, o.name, o.path from JobsetEvalMembers m "
+                 "join Builds b on m.build = b.id join BuildOutputs o on o.build = b.id "
+                 "where m.eval = $1 and b.project = $2 and b.jobset = $3")
+                (prevEval)(projectName)(jobsetName).exec();
+            for (auto const & row : res)
+                prevBuilds[{row["job"].as<std::string>(), row["name"].as<std::string>() + "\t" + row["path"].as<std::string>()}]
+                    = row["id"].as<BuildID>();
+
+            for (auto & job : jobs) {
+                auto i = prevBuilds.find({job.name, job.firstOutputName + "\t" + job.firstOutputPath});
+                if (i != prevBuilds.end()) job.id = i->second;
+            }
+
+            res = txn.parameterized
+                ("select count(*) from JobsetEvalMembers where eval = $1")(prevEval).exec();
+            nrPrevMembers = res[0][0].as<size_t>();
+        }
+
+        /* Allocate IDs for the new builds, and add them. */
+        size_t nrNew = 0;
+        for (auto & job : jobs)
+            if (!job.id) nrNew++;
+
+        if (nrNew) {
+            res = txn.parameterized
+                ("select nextval('builds_id_seq') from generate_series(1, $1)")(nrNew).exec();
+            auto id = res.begin();
+            for (auto & job : jobs)
+                if (!job.id) {
+                    job.id = (*id)[0].as<BuildID>();
+                    job.isNew = true;
+                    ++id;
+                }
+
+            time_t now = time(0);
+
+            std::vector<Row> builds, outputs;
+            for (auto & job : jobs) {
+                if (!job.isNew) continue;
+                auto & info(*job.info);
+                builds.push_back(
+                    { std::to_string(job.id)
+                    , "0"
+                    , std::to_string(now)
+                    , projectName
+                    , jobsetName
+                    , job.name
+                    , nullIfEmpty(info.getString("nixName"))
+                    , nullIfEmpty(info.getString("description"))
+                    , info.getString("drvPath")
+                    , info.getString("system")
+                    , nullIfEmpty(info.getString("license"))
+                    , nullIfEmpty(info.getString("homepage"))
+                    , nullIfEmpty(info.getString("maintainers"))
+                    , info.getString("maxSilent", "7200")
+                    , info.getString("timeout", "36000")
+                    , info.getString("isChannel", "0")
+                    , "1"
+                    , nixExprInput
+                    , nixExprPath
+                    , info.getString("schedulingPriority", "100")
+                    });
+                for (auto & output : info.get("outputs")->object)
+                    outputs.push_back({std::to_string(job.id), output.first, output.second.string});
+            }
+
+            copyRows(txn, "Builds",
+                { "id", "finished", "timestamp", "project", "jobset", "job"
+                , "nixName", "description", "drvPath", "system", "license", "homepage", "maintainers"
+                , "maxsilent", "timeout", "isChannel", "isCurrent", "nixExprInput", "nixExprPath", "priority" },
+                builds);
+
+            copyRows(txn, "BuildOutputs", {"build", "name", "path"}, outputs);
+        }
+
+        /* Have any builds been added or removed since last time? */
+        bool jobsetChanged = nrNew > 0 || (prevEval && nrPrevMembers != jobs.size());
+
+        res = txn.parameterized
+            ("insert into JobsetEvals (project, jobset, timestamp, checkoutTime, evalTime, hasNewBuilds, hash, nrBuilds) "
+             "values ($1, $2, $3, $4, $5, $6, $7, $8) returning id")
+            (projectName)(jobsetName)(time(0))(checkoutTime)(evalTime)
+            (jobsetChanged ? 1 : 0)(hash)(jobs.size(), jobsetChanged).exec();
+        auto evalId = res[0][0].as<unsigned int>();
+
+        if (jobsetChanged) {
+
+            /* Create JobsetEvalMembers mappings. */
+            {
+                std::vector<Row> rows;
+                for (auto & job : jobs)
+                    rows.push_back({std::to_string(evalId), std::to_string(job.id), job.isNew ? "1" : "0"});
+                copyRows(txn, "JobsetEvalMembers", {"eval", "build", "isNew"}, rows);
+            }
+
+            /* Create AggregateConstituents mappings. Since there can
+               be jobs that alias each other, if there are multiple
+               builds for the same derivation, pick the one with the
+               shortest name. */
+            std::map<std::string, const Job *> drvPathToJob;
+            for (auto & job : jobs) {
+                auto & y(drvPathToJob[job.info->getString("drvPath")]);
+                if (y && (job.name.size() > y->name.size()
+                        || (job.name.size() == y->name.size() && job.name >= y->name)))
+                    continue;
+                y = &job;
+            }
+
+            std::vector<Row> constituents;
+            for (auto & job : jobs) {
+                auto s = job.info->getString("constituents");
+                if (s == "") continue;
+                auto x = drvPathToJob[job.info->getString("drvPath")];
+                for (auto & drvPath : tokenizeString<Strings>(s)) {
+                    auto i = drvPathToJob.find(drvPath);
+                    if (i != drvPathToJob.end() && i->second)
+                        constituents.push_back({std::to_string(x->id), std::to_string(i->second->id)});
+                    else
+                        printMsg(lvlError, format("aggregate job ‘%1%’ has a constituent ‘%2%’ that doesn't correspond to a Hydra build")
+                            % job.name % drvPath);
+                }
+            }
+
+            if (!constituents.empty()) {
+                /* Existing aggregates may already have their
+                   constituents recorded. */
+                txn.exec("create temporary table ImportConstituents (aggregate integer not null, constituent integer not null) on commit drop");
+                copyRows(txn, "ImportConstituents", {"aggregate", "constituent"}, constituents);
+                txn.exec
+                    ("insert into AggregateConstituents (aggregate, constituent) "
+                     "select distinct aggregate, constituent from ImportConstituents i where not exists "
+                     "(select 1 from AggregateConstituents a where a.aggregate = i.aggregate and a.constituent = i.constituent)");
+            }
+
+            /* Record the inputs of the evaluation. */
+            if (inputsJSON.type == JSONValue::tObject) {
+                std::vector<Row> rows;
+                for (auto & i : inputsJSON.object) {
+                    unsigned int altNr = 0;
+                    for (auto & input : i.second.array)
+                        rows.push_back(
+                            { std::to_string(evalId)
+                            , i.first
+                            , std::to_string(altNr++)
+                            , input.getString("type")
+                            , input.getString("uri", null)
+                            , input.getString("revision", null)
+                            , input.getString("value", null)
+                            , input.getString("id", null)
+                            , input.getString("storePath")
+                            , input.getString("sha256hash", null)
+                            });
+                }
+                copyRows(txn, "JobsetEvalInputs",
+                    {"eval", "name", "altNr", "type", "uri", "revision", "value", "dependency", "path", "sha256hash"},
+                    rows);
+            }
+
+            txn.parameterized
+                ("update Builds set isCurrent = 1 where id in (select build from JobsetEvalMembers where eval = $1)")
+                (evalId).exec();
+
+        } else if (prevEval)
+            txn.parameterized
+                ("update Builds set isCurrent = 1 where id in (select build from JobsetEvalMembers where eval = $1)")
+                (prevEval).exec();
+
+        /* If this is a one-shot jobset, disable it now. */
+        txn.parameterized
+            ("update Jobsets set enabled = 0 where project = $1 and name = $2 and enabled = 2")
+            (projectName)(jobsetName).exec();
+
+        txn.parameterized
+            ("update Jobsets set lastCheckedTime = $3 where project = $1 and name = $2")
+            (projectName)(jobsetName)(time(0)).exec();
+
+        /* Hand the step graph of this evaluation to the queue
+           runner. This must happen before the commit, since the queue
+           runner may look for it as soon as the builds are
+           visible. */
+        if (jobsetChanged && stepGraphFile != "" && pathExists(stepGraphFile)) {
+            Path dst = dirOf(stepGraphFile) + "/" + std::to_string(evalId);
+            if (rename(stepGraphFile.c_str(), dst.c_str()) == -1)
+                printMsg(lvlError, format("cannot rename step graph ‘%1%’: %2%") % stepGraphFile % strerror(errno));
+        }
+
+        txn.commit();
+
+        printMsg(lvlInfo, format("added %1% new builds out of %2% jobs") % nrNew % jobs.size());
+
+        std::cout << evalId << " " << (jobsetChanged ? 1 : 0) << std::endl;
+    });
+}
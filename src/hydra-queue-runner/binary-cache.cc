@@ -0,0 +1,187 @@
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "state.hh"
+
+#include "archive.hh"
+#include "util.hh"
+
+using namespace nix;
+
+
+/* The magic number preceding the metadata of each path in the
+   ‘nix-store --export’ format. */
+static const unsigned int exportMagic = 0x4558494e;
+
+
+void State::binaryCacheWriter()
+{
+    while (true) {
+        try {
+
+            Path spoolFile;
+            {
+                auto binaryCacheQueue_(binaryCacheQueue.lock());
+                while (binaryCacheQueue_->empty())
+                    binaryCacheQueue_.wait(binaryCacheWakeup);
+                spoolFile = binaryCacheQueue_->front();
+                binaryCacheQueue_->pop();
+            }
+
+            AutoDelete autoDelete(spoolFile, false);
+
+            struct stat st;
+            if (stat(spoolFile.c_str(), &st) == -1)
+                throw SysError(format("getting status of ‘%1%’") % spoolFile);
+            binaryCacheBacklogBytes -= st.st_size;
+
+            auto startTime = std::chrono::steady_clock::now();
+
+            auto store = openStore(); // FIXME: pool
+            writeSpoolFile(store, spoolFile);
+
+            auto stopTime = std::chrono::steady_clock::now();
+            totalNarWriteTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(stopTime - startTime).count();
+
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("binary cache writer: %1%") % e.what());
+        }
+    }
+}
+
+
+/* A source that counts the number of bytes read through it. */
+struct CountingSource : Source
+{
+    Source & next;
+    unsigned long long count = 0;
+    CountingSource(Source & next) : next(next) { }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = next.read(data, len);
+        count += n;
+        return n;
+    }
+};
+
+
+void State::writeSpoolFile(std::shared_ptr<StoreAPI> store, const Path & spoolFile)
+{
+    AutoCloseFD fd(open(spoolFile.c_str(), O_RDONLY));
+    if (fd == -1) throw SysError(format("opening ‘%1%’") % spoolFile);
+
+    FdSource fdSource(fd);
+    CountingSource source(fdSource);
+
+    while (readInt(source) == 1) {
+
+        /* Find the extent of the NAR in the spool file. The path
+           comes after the NAR, so we can only tell whether it's
+           already in the binary cache after parsing the NAR. */
+        auto narStart = source.count;
+        {
+            ParseSink sink; /* null sink; just parse the NAR */
+            parseDump(sink, source);
+        }
+        auto narEnd = source.count;
+
+        /* Skip the metadata; we get it from the store instead. */
+        if (readInt(source) != exportMagic)
+            throw Error(format("spool file ‘%1%’ is corrupt") % spoolFile);
+        Path path = readStorePath(source);
+        readStorePaths<PathSet>(source); // references
+        readString(source); // deriver
+        if (readInt(source) == 1)
+            readString(source); // signature
+
+        Path narInfoFile = binaryCacheDir + "/" + storePathToHash(path) + ".narinfo";
+        if (pathExists(narInfoFile)) continue;
+
+        auto info = store->queryPathInfo(path);
+
+        /* Pipe the NAR through xz into a temporary file. */
+        Path tmpFile = spoolFile + ".nar.xz";
+        AutoDelete tmpFileDel(tmpFile, false);
+
+        AutoCloseFD tmpFD(open(tmpFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644));
+        if (tmpFD == -1) throw SysError(format("creating ‘%1%’") % tmpFile);
+
+        Pipe pipe;
+        pipe.create();
+
+        Pid pid = startProcess([&]() {
+            if (dup2(pipe.readSide, STDIN_FILENO) == -1)
+                throw SysError("cannot dup input pipe to stdin");
+            if (dup2(tmpFD, STDOUT_FILENO) == -1)
+                throw SysError("cannot dup output pipe to stdout");
+            execlp("xz", "xz", "-c", nullptr);
+            throw SysError("cannot start xz");
+        });
+
+        pipe.readSide.close();
+        tmpFD.close();
+
+        {
+            AutoCloseFD narFD(open(spoolFile.c_str(), O_RDONLY));
+            if (narFD == -1) throw SysError(format("opening ‘%1%’") % spoolFile);
+            if (lseek(narFD, narStart, SEEK_SET) == -1)
+                throw SysError(format("seeking in ‘%1%’") % spoolFile);
+            std::vector<unsigned char> buf(65536);
+            auto left = narEnd - narStart;
+            while (left) {
+                size_t n = std::min((unsigned long long) buf.size(), left);
+                readFull(narFD, buf.data(), n);
+                writeFull(pipe.writeSide, buf.data(), n);
+                left -= n;
+            }
+        }
+
+        pipe.writeSide.close();
+
+        int res = pid.wait(true);
+        if (res != 0)
+            throw Error(format("xz %1%") % statusToString(res));
+
+        Hash fileHash = hashFile(htSHA256, tmpFile);
+        struct stat st;
+        if (stat(tmpFile.c_str(), &st) == -1)
+            throw SysError(format("getting status of ‘%1%’") % tmpFile);
+
+        string narFile = "nar/" + printHash32(fileHash) + ".nar.xz";
+        Path narPath = binaryCacheDir + "/" + narFile;
+        if (rename(tmpFile.c_str(), narPath.c_str()) == -1)
+            throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmpFile % narPath);
+        tmpFileDel.cancel();
+
+        string narInfo;
+        narInfo += "StorePath: " + path + "\n";
+        narInfo += "URL: " + narFile + "\n";
+        narInfo += "Compression: xz\n";
+        narInfo += "FileHash: sha256:" + printHash32(fileHash) + "\n";
+        narInfo += (format("FileSize: %1%\n") % st.st_size).str();
+        narInfo += "NarHash: sha256:" + printHash32(info.hash) + "\n";
+        narInfo += (format("NarSize: %1%\n") % info.narSize).str();
+        Strings refs;
+        for (auto & ref : info.references)
+            refs.push_back(baseNameOf(ref));
+        narInfo += "References: " + concatStringsSep(" ", refs) + "\n";
+        if (info.deriver != "")
+            narInfo += "Deriver: " + baseNameOf(info.deriver) + "\n";
+
+        /* Write the narinfo file last and atomically, so that clients
+           never see it before the NAR. */
+        Path tmpNarInfoFile = spoolFile + ".narinfo";
+        writeFile(tmpNarInfoFile, narInfo);
+        if (rename(tmpNarInfoFile.c_str(), narInfoFile.c_str()) == -1)
+            throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmpNarInfoFile % narInfoFile);
+
+        nrNarsWritten++;
+        bytesNarsWritten += info.narSize;
+        bytesNarsCompressed += st.st_size;
+
+        printMsg(lvlChatty, format("wrote ‘%1%’ to the binary cache") % path);
+    }
+}
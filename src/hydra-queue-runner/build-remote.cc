@@ -74,10 +74,61 @@ static void openConnection(Machine::ptr machine, Path tmpDir, int stderrFD, Chil
 }
 
 
-static void copyClosureTo(std::shared_ptr<StoreAPI> store,
+/* Perform the ‘nix-store --serve’ handshake and return the protocol
+   version of the remote side. */
+static unsigned int handshake(Machine::ptr machine, FdSource & from, FdSink & to)
+{
+    to << SERVE_MAGIC_1 << 0x202;
+    to.flush();
+
+    unsigned int magic = readInt(from);
+    if (magic != SERVE_MAGIC_2)
+        throw Error(format("protocol mismatch with ‘nix-store --serve’ on ‘%1%’") % machine->sshName);
+    unsigned int remoteVersion = readInt(from);
+    if (GET_PROTOCOL_MAJOR(remoteVersion) != 0x200)
+        throw Error(format("unsupported ‘nix-store --serve’ protocol version on ‘%1%’") % machine->sshName);
+
+    return remoteVersion;
+}
+
+
+/* Return the paths that must be present on the remote machine to
+   build ‘step’. If the remote side is Nix <= 1.9, we have to copy the
+   entire closure of ‘drvPath’, as well as the required outputs of the
+   input derivations. On Nix > 1.9, we only need to copy the immediate
+   sources of the derivation and the required outputs of the input
+   derivations, which are also added to the inputs of ‘basicDrv’. */
+static PathSet getInputs(Step::ptr step, bool sendDerivation, BasicDerivation * basicDrv)
+{
+    PathSet inputs;
+
+    if (sendDerivation)
+        inputs.insert(step->drvPath);
+    else
+        for (auto & p : step->drv.inputSrcs)
+            inputs.insert(p);
+
+    for (auto & input : step->drv.inputDrvs) {
+        Derivation drv2 = readDerivation(input.first);
+        for (auto & name : input.second) {
+            auto i = drv2.outputs.find(name);
+            if (i == drv2.outputs.end()) continue;
+            inputs.insert(i->second.path);
+            if (basicDrv) basicDrv->inputSrcs.insert(i->second.path);
+        }
+    }
+
+    return inputs;
+}
+
+
+/* Copy the closure of ‘paths’ to the remote machine. If
+   ‘giveWay’ is set (when prefetching), the paths are sent one at a
+   time, and the copy stops early (returning false) as soon as
+   another thread is waiting to send to the same machine. */
+static bool copyClosureTo(std::shared_ptr<StoreAPI> store,
     FdSource & from, FdSink & to, const PathSet & paths,
-    counter & bytesSent,
-    bool useSubstitutes = false)
+    counter & bytesSent, Machine::ptr machine, bool giveWay = false)
 {
     PathSet closure;
     for (auto & path : paths)
@@ -85,16 +136,46 @@ static void copyClosureTo(std::shared_ptr<StoreAPI> store,
 
     /* Send the "query valid paths" command with the "lock" option
        enabled. This prevents a race where the remote host
-       garbage-collect paths that are already there. Optionally, ask
-       the remote host to substitute missing paths. */
-    to << cmdQueryValidPaths << 1 << useSubstitutes << closure;
+       garbage-collect paths that are already there. */
+    to << cmdQueryValidPaths << 1 << 0 << closure;
     to.flush();
 
     /* Get back the set of paths that are already valid on the remote
        host. */
     auto present = readStorePaths<PathSet>(from);
 
-    if (present.size() == closure.size()) return;
+    if (present.size() == closure.size()) return true;
+
+    /* Optionally, ask the remote host to substitute the missing paths
+       from its binary caches. This is usually much faster than
+       uploading them from here. Whatever it couldn't substitute is
+       uploaded below. */
+    if (machine->useSubstitutes) {
+        PathSet missing;
+        for (auto & p : closure)
+            if (present.find(p) == present.end()) missing.insert(p);
+
+        auto startTime = std::chrono::steady_clock::now();
+
+        to << cmdQueryValidPaths << 1 << 1 << missing;
+        to.flush();
+        auto substituted = readStorePaths<PathSet>(from);
+
+        auto stopTime = std::chrono::steady_clock::now();
+        machine->state->totalSubstitutionTimeMs +=
+            std::chrono::duration_cast<std::chrono::milliseconds>(stopTime - startTime).count();
+
+        printMsg(lvlDebug, format("‘%1%’ substituted %2% of %3% missing paths")
+            % machine->sshName % substituted.size() % missing.size());
+
+        for (auto & p : substituted) {
+            machine->state->nrPathsSubstituted++;
+            machine->state->bytesSubstituted += store->queryPathInfo(p).narSize;
+            present.insert(p);
+        }
+
+        if (present.size() == closure.size()) return true;
+    }
 
     Paths sorted = topoSortPaths(*store, closure);
 
@@ -104,6 +185,19 @@ static void copyClosureTo(std::shared_ptr<StoreAPI> store,
 
     printMsg(lvlDebug, format("sending %1% missing paths") % missing.size());
 
+    if (giveWay) {
+        for (auto & p : missing) {
+            if (machine->state->nrSendersWaiting) return false;
+            to << cmdImportPaths;
+            exportPaths(*store, {p}, false, to);
+            to.flush();
+            if (readInt(from) != 1)
+                throw Error("remote machine failed to import closure");
+            bytesSent += store->queryPathInfo(p).narSize;
+        }
+        return true;
+    }
+
     for (auto & p : missing)
         bytesSent += store->queryPathInfo(p).narSize;
 
@@ -113,65 +207,118 @@ static void copyClosureTo(std::shared_ptr<StoreAPI> store,
 
     if (readInt(from) != 1)
         throw Error("remote machine failed to import closure");
+
+    return true;
 }
 
 
+/* Copy ‘paths’ from the remote machine. If ‘spoolFD’ is not -1, the
+   export stream is also written to it, for the binary cache
+   writers. */
 static void copyClosureFrom(std::shared_ptr<StoreAPI> store,
-    FdSource & from, FdSink & to, const PathSet & paths, counter & bytesReceived)
+    FdSource & from, FdSink & to, const PathSet & paths, counter & bytesReceived,
+    int spoolFD)
 {
     to << cmdExportPaths << 0 << paths;
     to.flush();
-    store->importPaths(false, from);
+    if (spoolFD != -1) {
+        FdTeeSource tee(from, spoolFD);
+        store->importPaths(false, tee);
+    } else
+        store->importPaths(false, from);
 
     for (auto & p : paths)
         bytesReceived += store->queryPathInfo(p).narSize;
 }
 
 
-void State::buildRemote(std::shared_ptr<StoreAPI> store,
-    Machine::ptr machine, Step::ptr step,
-    unsigned int maxSilentTime, unsigned int buildTimeout,
-    RemoteResult & result)
+struct RemoteSession
 {
-    string base = baseNameOf(step->drvPath);
-    result.logFile = logDir + "/" + string(base, 0, 2) + "/" + string(base, 2);
-    AutoDelete autoDelete(result.logFile, false);
+    /* The steps to be built in this session. */
+    std::vector<Step::ptr> steps;
 
-    createDirs(dirOf(result.logFile));
-
-    AutoCloseFD logFD(open(result.logFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666));
-    if (logFD == -1) throw SysError(format("creating log file ‘%1%’") % result.logFile);
+    Path tmpDir;
+    std::shared_ptr<AutoDelete> tmpDirDel;
 
-    nix::Path tmpDir = createTempDir();
-    AutoDelete tmpDirDel(tmpDir, true);
+    /* The file receiving the stderr of the remote side. */
+    Path logFile;
 
     Child child;
-    openConnection(machine, tmpDir, logFD, child);
+    std::shared_ptr<FdSource> from;
+    std::shared_ptr<FdSink> to;
+
+    bool sendDerivation = true;
+    unsigned int remoteVersion = 0;
+
+    RemoteSession(const std::vector<Step::ptr> & steps) : steps(steps) { }
+
+    ~RemoteSession()
+    {
+        try {
+            close();
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("closing session: %1%") % e.what());
+        }
+    }
+
+    bool isOpen() { return (bool) from; }
+
+    /* Shut down the connection, letting the remote side exit. */
+    void close()
+    {
+        if (!from) return;
+        from = 0;
+        to = 0;
+        child.to.close();
+        child.from.close();
+        child.pid.wait(true);
+    }
+
+    /* Shut down the connection after an error. */
+    void kill()
+    {
+        from = 0;
+        to = 0;
+        child.to.close();
+        child.from.close();
+        child.pid.kill();
+    }
+};
+
+
+std::shared_ptr<RemoteSession> State::createSession(const std::vector<Step::ptr> & steps)
+{
+    return std::make_shared<RemoteSession>(steps);
+}
+
+
+void State::openSession(std::shared_ptr<StoreAPI> store, Machine::ptr machine,
+    RemoteSession & session, const Path & logFile)
+{
+    if (!session.tmpDirDel) {
+        session.tmpDir = createTempDir();
+        session.tmpDirDel = std::make_shared<AutoDelete>(session.tmpDir, true);
+    }
+
+    session.logFile = logFile != "" ? logFile : session.tmpDir + "/log";
+
+    AutoCloseFD logFD(open(session.logFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666));
+    if (logFD == -1) throw SysError(format("creating log file ‘%1%’") % session.logFile);
+
+    openConnection(machine, session.tmpDir, logFD, session.child);
 
     logFD.close();
 
-    FdSource from(child.from);
-    FdSink to(child.to);
+    auto from = std::make_shared<FdSource>(session.child.from);
+    auto to = std::make_shared<FdSink>(session.child.to);
 
     /* Handshake. */
-    bool sendDerivation = true;
-    unsigned int remoteVersion;
-
     try {
-        to << SERVE_MAGIC_1 << 0x202;
-        to.flush();
-
-        unsigned int magic = readInt(from);
-        if (magic != SERVE_MAGIC_2)
-            throw Error(format("protocol mismatch with ‘nix-store --serve’ on ‘%1%’") % machine->sshName);
-        remoteVersion = readInt(from);
-        if (GET_PROTOCOL_MAJOR(remoteVersion) != 0x200)
-            throw Error(format("unsupported ‘nix-store --serve’ protocol version on ‘%1%’") % machine->sshName);
-        if (GET_PROTOCOL_MINOR(remoteVersion) >= 1)
-            sendDerivation = false;
+        session.remoteVersion = handshake(machine, *from, *to);
+        session.sendDerivation = GET_PROTOCOL_MINOR(session.remoteVersion) < 1;
 
     } catch (EndOfFile & e) {
-        child.pid.wait(true);
+        session.child.pid.wait(true);
 
         {
             /* Disable this machine until a certain period of time has
@@ -190,7 +337,7 @@ void State::buildRemote(std::shared_ptr<StoreAPI> store,
             }
         }
 
-        string s = chomp(readFile(result.logFile));
+        string s = chomp(readFile(session.logFile));
         throw Error(format("cannot connect to ‘%1%’: %2%") % machine->sshName % s);
     }
 
@@ -199,95 +346,327 @@ void State::buildRemote(std::shared_ptr<StoreAPI> store,
         info->consecutiveFailures = 0;
     }
 
-    /* Gather the inputs. If the remote side is Nix <= 1.9, we have to
-       copy the entire closure of ‘drvPath’, as well as the required
-       outputs of the input derivations. On Nix > 1.9, we only need to
-       copy the immediate sources of the derivation and the required
-       outputs of the input derivations. */
-    PathSet inputs;
-    BasicDerivation basicDrv(step->drv);
+    session.from = from;
+    session.to = to;
 
-    if (sendDerivation)
-        inputs.insert(step->drvPath);
-    else
-        for (auto & p : step->drv.inputSrcs)
+    /* Copy the input closures of all steps in the session at once. */
+    PathSet inputs;
+    for (auto & step : session.steps) {
+        notePrefetchUse(step, machine);
+        for (auto & p : getInputs(step, session.sendDerivation, 0))
             inputs.insert(p);
-
-    for (auto & input : step->drv.inputDrvs) {
-        Derivation drv2 = readDerivation(input.first);
-        for (auto & name : input.second) {
-            auto i = drv2.outputs.find(name);
-            if (i == drv2.outputs.end()) continue;
-            inputs.insert(i->second.path);
-            basicDrv.inputSrcs.insert(i->second.path);
-        }
     }
 
-    /* Copy the input closure. */
     if (machine->sshName != "localhost") {
         auto mc1 = std::make_shared<MaintainCount>(nrStepsWaiting);
+        auto mc3 = std::make_shared<MaintainCount>(machine->state->nrSendersWaiting);
         std::lock_guard<std::mutex> sendLock(machine->state->sendLock);
         mc1.reset();
+        mc3.reset();
         MaintainCount mc2(nrStepsCopyingTo);
-        printMsg(lvlDebug, format("sending closure of ‘%1%’ to ‘%2%’") % step->drvPath % machine->sshName);
-        copyClosureTo(store, from, to, inputs, bytesSent);
+        printMsg(lvlDebug, format("sending closure of %1% step(s) to ‘%2%’") % session.steps.size() % machine->sshName);
+        copyClosureTo(store, *from, *to, inputs, bytesSent, machine);
     }
+}
 
-    autoDelete.cancel();
 
-    /* Do the build. */
-    printMsg(lvlDebug, format("building ‘%1%’ on ‘%2%’") % step->drvPath % machine->sshName);
+/* Copy the part of ‘from’ starting at ‘offset’ to the file ‘to’. */
+static void copyLogSegment(const Path & from, off_t offset, const Path & to)
+{
+    AutoCloseFD fromFD(open(from.c_str(), O_RDONLY));
+    if (fromFD == -1) throw SysError(format("opening ‘%1%’") % from);
+    if (lseek(fromFD, offset, SEEK_SET) == -1)
+        throw SysError(format("seeking in ‘%1%’") % from);
+    AutoCloseFD toFD(open(to.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666));
+    if (toFD == -1) throw SysError(format("creating log file ‘%1%’") % to);
+    unsigned char buf[65536];
+    while (true) {
+        ssize_t n = read(fromFD, buf, sizeof(buf));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError(format("reading ‘%1%’") % from);
+        }
+        if (n == 0) break;
+        writeFull(toFD, buf, n);
+    }
+}
 
-    if (sendDerivation)
-        to << cmdBuildPaths << PathSet({step->drvPath});
-    else
-        to << cmdBuildDerivation << step->drvPath << basicDrv;
-    to << maxSilentTime << buildTimeout;
-    if (GET_PROTOCOL_MINOR(remoteVersion) >= 2)
-        to << 64 * 1024 * 1024; // == maxLogSize
-    to.flush();
 
-    result.startTime = time(0);
-    int res;
-    {
-        MaintainCount mc(nrStepsBuilding);
-        res = readInt(from);
-    }
-    result.stopTime = time(0);
-
-    if (sendDerivation) {
-        if (res) {
-            result.errorMsg = (format("%1% on ‘%2%’") % readString(from) % machine->sshName).str();
-            if (res == 100) result.status = BuildResult::PermanentFailure;
-            else if (res == 101) result.status = BuildResult::TimedOut;
-            else result.status = BuildResult::MiscFailure;
-            return;
+static off_t getFileSize(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError(format("getting status of ‘%1%’") % path);
+    return st.st_size;
+}
+
+
+void State::buildRemote(std::shared_ptr<StoreAPI> store,
+    Machine::ptr machine, Step::ptr step,
+    unsigned int maxSilentTime, unsigned int buildTimeout,
+    RemoteResult & result, std::shared_ptr<RemoteSession> session)
+{
+    string base = baseNameOf(step->drvPath);
+    result.logFile = logDir + "/" + string(base, 0, 2) + "/" + string(base, 2);
+    AutoDelete autoDelete(result.logFile, false);
+
+    createDirs(dirOf(result.logFile));
+
+    /* Steps that are not part of a batch get a session of their own,
+       with the stderr of the remote side going straight to the log
+       file. In a batch, the log of each step is cut out of the log of
+       the session. */
+    bool batched = (bool) session;
+    if (!batched) session = createSession({step});
+
+    try {
+
+        if (!session->isOpen())
+            openSession(store, machine, *session, batched ? "" : result.logFile);
+
+        FdSource & from(*session->from);
+        FdSink & to(*session->to);
+
+        off_t logStart = batched ? getFileSize(session->logFile) : 0;
+
+        BasicDerivation basicDrv(step->getFullDerivation());
+        getInputs(step, session->sendDerivation, &basicDrv);
+
+        autoDelete.cancel();
+
+        /* Do the build. */
+        printMsg(lvlDebug, format("building ‘%1%’ on ‘%2%’") % step->drvPath % machine->sshName);
+
+        if (session->sendDerivation)
+            to << cmdBuildPaths << PathSet({step->drvPath});
+        else
+            to << cmdBuildDerivation << step->drvPath << basicDrv;
+        to << maxSilentTime << buildTimeout;
+        if (GET_PROTOCOL_MINOR(session->remoteVersion) >= 2)
+            to << 64 * 1024 * 1024; // == maxLogSize
+        to.flush();
+
+        result.startTime = time(0);
+        int res;
+        {
+            MaintainCount mc(nrStepsBuilding);
+            res = readInt(from);
+        }
+        result.stopTime = time(0);
+
+        if (batched)
+            copyLogSegment(session->logFile, logStart, result.logFile);
+
+        if (session->sendDerivation) {
+            if (res) {
+                result.errorMsg = (format("%1% on ‘%2%’") % readString(from) % machine->sshName).str();
+                if (res == 100) result.status = BuildResult::PermanentFailure;
+                else if (res == 101) result.status = BuildResult::TimedOut;
+                else result.status = BuildResult::MiscFailure;
+                return;
+            }
+            result.status = BuildResult::Built;
+        } else {
+            result.status = (BuildResult::Status) res;
+            result.errorMsg = readString(from);
+            if (!result.success()) return;
         }
-        result.status = BuildResult::Built;
-    } else {
-        result.status = (BuildResult::Status) res;
-        result.errorMsg = readString(from);
-        if (!result.success()) return;
-    }
 
-    /* If the path was substituted or already valid, then we didn't
-       get a build log. */
-    if (result.status == BuildResult::Substituted || result.status == BuildResult::AlreadyValid) {
-        unlink(result.logFile.c_str());
-        result.logFile = "";
-    }
+        /* If the path was substituted or already valid, then we didn't
+           get a build log. */
+        if (result.status == BuildResult::Substituted || result.status == BuildResult::AlreadyValid) {
+            unlink(result.logFile.c_str());
+            result.logFile = "";
+        }
 
-    /* Copy the output paths. */
-    if (machine->sshName != "localhost") {
-        printMsg(lvlDebug, format("copying outputs of ‘%1%’ from ‘%2%’") % step->drvPath % machine->sshName);
-        PathSet outputs;
-        for (auto & output : step->drv.outputs)
-            outputs.insert(output.second.path);
-        MaintainCount mc(nrStepsCopyingFrom);
-        copyClosureFrom(store, from, to, outputs, bytesReceived);
+        /* Copy the output paths. */
+        if (machine->sshName != "localhost") {
+            printMsg(lvlDebug, format("copying outputs of ‘%1%’ from ‘%2%’") % step->drvPath % machine->sshName);
+            PathSet outputs;
+            for (auto & output : step->drv.outputs)
+                outputs.insert(output.second.path);
+            MaintainCount mc(nrStepsCopyingFrom);
+
+            Path spoolFile;
+            AutoCloseFD spoolFD(-1);
+            std::shared_ptr<AutoDelete> spoolFileDel;
+            if (binaryCacheDir != "") {
+                spoolFile = (format("%1%/tmp/spool-%2%-%3%") % binaryCacheDir % getpid() % nrSpoolFiles++).str();
+                spoolFD = open(spoolFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+                if (spoolFD == -1) throw SysError(format("creating ‘%1%’") % spoolFile);
+                spoolFileDel = std::make_shared<AutoDelete>(spoolFile, false);
+            }
+
+            copyClosureFrom(store, from, to, outputs, bytesReceived, spoolFD);
+
+            /* Hand the spooled outputs to the binary cache writers. */
+            if (spoolFileDel) {
+                struct stat st;
+                if (fstat(spoolFD, &st) == -1)
+                    throw SysError(format("getting status of ‘%1%’") % spoolFile);
+                spoolFD.close();
+                spoolFileDel->cancel();
+                binaryCacheBacklogBytes += st.st_size;
+                {
+                    auto binaryCacheQueue_(binaryCacheQueue.lock());
+                    binaryCacheQueue_->push(spoolFile);
+                }
+                binaryCacheWakeup.notify_one();
+            }
+        }
+
+    } catch (...) {
+        /* The session is in an unknown state, so the next step in the
+           batch (if any) has to start a new one. That one only needs
+           the inputs of the steps after this one. (Steps that are not
+           in the list were added after all the others.) */
+        session->kill();
+        auto & steps(session->steps);
+        auto i = std::find(steps.begin(), steps.end(), step);
+        steps.erase(steps.begin(), i == steps.end() ? i : i + 1);
+        throw;
     }
 
     /* Shut down the connection. */
-    child.to.close();
-    child.pid.wait(true);
+    if (!batched) session->close();
+}
+
+
+void State::notePrefetchUse(Step::ptr step, Machine::ptr machine)
+{
+    auto prefetches_(prefetches.lock());
+    auto i = prefetches_->find(step->drvPath);
+    if (i == prefetches_->end()) return;
+
+    if (i->second.status != Prefetch::queued) {
+        if (i->second.machine == machine)
+            nrPrefetchHits++;
+        else {
+            nrPrefetchMisses++;
+            bytesPrefetchWasted += i->second.bytes;
+        }
+    }
+
+    prefetches_->erase(i);
+}
+
+
+void State::prefetcher()
+{
+    while (true) {
+        try {
+            Step::ptr step;
+            Machine::ptr machine;
+            std::unique_lock<std::mutex> sendLock;
+
+            {
+                auto prefetches_(prefetches.lock());
+
+                while (true) {
+                    for (auto i = prefetches_->begin(); i != prefetches_->end(); ) {
+
+                        /* Forget about steps that have gone away
+                           without being built. */
+                        auto step2 = i->second.step.lock();
+                        if (!step2) {
+                            bytesPrefetchWasted += i->second.bytes;
+                            i = prefetches_->erase(i);
+                            continue;
+                        }
+
+                        /* Only use spare bandwidth, i.e. skip
+                           machines that are currently receiving the
+                           inputs of a running step. */
+                        if (!step && i->second.status == Prefetch::queued
+                            && !i->second.machine->state->nrSendersWaiting)
+                        {
+                            std::unique_lock<std::mutex> lock(i->second.machine->state->sendLock, std::try_to_lock);
+                            if (lock.owns_lock()) {
+                                step = step2;
+                                machine = i->second.machine;
+                                sendLock = std::move(lock);
+                                i->second.status = Prefetch::sending;
+                            }
+                        }
+
+                        ++i;
+                    }
+
+                    if (step) break;
+
+                    prefetches_.wait_until(prefetcherWakeup,
+                        std::chrono::system_clock::now() + std::chrono::seconds(5));
+                }
+            }
+
+            printMsg(lvlDebug, format("prefetching inputs of ‘%1%’ to ‘%2%’") % step->drvPath % machine->sshName);
+
+            std::shared_ptr<AutoDelete> tmpDirDel;
+            Child child;
+
+            counter sent{0};
+            bool failed = false;
+
+            /* Note: the paths sent before a failure or an abort are
+               still useful, so the prefetch is marked as done in
+               either case. A prefetch that failed before sending
+               anything is forgotten. */
+            try {
+                auto store = openStore(); // FIXME: pool
+
+                nix::Path tmpDir = createTempDir();
+                tmpDirDel = std::make_shared<AutoDelete>(tmpDir, true);
+
+                AutoCloseFD devNull(open("/dev/null", O_WRONLY));
+                if (devNull == -1) throw SysError("opening /dev/null");
+
+                openConnection(machine, tmpDir, devNull, child);
+
+                FdSource from(child.from);
+                FdSink to(child.to);
+
+                auto remoteVersion = handshake(machine, from, to);
+                PathSet inputs = getInputs(step, GET_PROTOCOL_MINOR(remoteVersion) < 1, 0);
+                if (copyClosureTo(store, from, to, inputs, sent, machine, true))
+                    nrPrefetches++;
+                else {
+                    printMsg(lvlDebug, format("aborted prefetching inputs of ‘%1%’ to ‘%2%’")
+                        % step->drvPath % machine->sshName);
+                    nrPrefetchesAborted++;
+                }
+            } catch (Error & e) {
+                printMsg(lvlInfo, format("cannot prefetch inputs of ‘%1%’ to ‘%2%’: %3%")
+                    % step->drvPath % machine->sshName % e.msg());
+                nrPrefetchesFailed++;
+                failed = true;
+            }
+
+            sendLock.unlock();
+
+            if (child.pid != -1) {
+                child.to.close();
+                child.pid.wait(true);
+            }
+
+            bytesSent += sent;
+            bytesPrefetched += sent;
+
+            {
+                auto prefetches_(prefetches.lock());
+                auto i = prefetches_->find(step->drvPath);
+                if (i != prefetches_->end()) {
+                    if (failed && !sent)
+                        prefetches_->erase(i);
+                    else {
+                        i->second.status = Prefetch::done;
+                        i->second.bytes = sent;
+                    }
+                }
+            }
+
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("prefetcher: %1%") % e.what());
+            sleep(5);
+        }
+    }
 }
@@ -3,25 +3,59 @@
 #include "state.hh"
 #include "build-result.hh"
 
+#include "names.hh"
+
 using namespace nix;
 
 
 void State::builder(MachineReservation::ptr reservation)
 {
-    bool retry = true;
-
     MaintainCount mc(nrActiveSteps);
 
-    auto step = reservation->step;
+    auto machine = reservation->machine;
+
+    /* Build the reserved step, followed by the other steps in its
+       batch (if any) over the same connection. */
+    std::vector<Step::ptr> steps{reservation->step};
+    steps.insert(steps.end(), reservation->batch.begin(), reservation->batch.end());
+
+    auto session = steps.size() > 1 ? createSession(steps) : 0;
+
+    std::vector<Step::ptr> retries;
+
+    /* Note: ‘steps’ may grow while we iterate over it. */
+    for (size_t n = 0; n < steps.size(); n++) {
+        auto step = steps[n];
+        bool retry = true;
+        bool outputsValid = false;
+
+        try {
+            auto store = openStore(); // FIXME: pool
+            retry = doBuildStep(store, step, machine, session);
+            if (!retry && step->isFixedOutput)
+                outputsValid = store->isValidPath(step->drv.outputs.begin()->second.path);
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("uncaught exception building ‘%1%’ on ‘%2%’: %3%")
+                % step->drvPath % machine->sshName % e.what());
+        }
 
-    try {
-        auto store = openStore(); // FIXME: pool
-        retry = doBuildStep(store, step, reservation->machine);
-    } catch (std::exception & e) {
-        printMsg(lvlError, format("uncaught exception building ‘%1%’ on ‘%2%’: %3%")
-            % step->drvPath % reservation->machine->sshName % e.what());
+        if (retry) retries.push_back(step);
+
+        /* If this step produced its fixed output, then finish the
+           steps that were waiting for it here. Otherwise, put them
+           back in the runnable queue so that one of them can be
+           tried. */
+        if (step->isFixedOutput)
+            for (auto & twin : releaseTwins(step)) {
+                if (outputsValid && machine->supportsStep(twin))
+                    steps.push_back(twin);
+                else
+                    makeRunnable(twin);
+            }
     }
 
+    session = 0;
+
     /* Release the machine and wake up the dispatcher. */
     assert(reservation.unique());
     reservation = 0;
@@ -29,7 +63,7 @@ void State::builder(MachineReservation::ptr reservation)
 
     /* If there was a temporary failure, retry the step after an
        exponentially increasing interval. */
-    if (retry) {
+    for (auto & step : retries) {
         {
             auto step_(step->state.lock());
             step_->tries++;
@@ -46,7 +80,7 @@ void State::builder(MachineReservation::ptr reservation)
 
 
 bool State::doBuildStep(std::shared_ptr<StoreAPI> store, Step::ptr step,
-    Machine::ptr machine)
+    Machine::ptr machine, std::shared_ptr<RemoteSession> session)
 {
     {
         auto step_(step->state.lock());
@@ -103,11 +137,22 @@ bool State::doBuildStep(std::shared_ptr<StoreAPI> store, Step::ptr step,
 
     /* If any of the outputs have previously failed, then don't bother
        building again. */
-    bool cachedFailure = checkCachedFailure(step, *conn);
+    bool cachedFailure = checkCachedFailure(step, *getReadOnlyConnection());
+
+    /* If this is a fixed-output step whose output has been produced
+       in the meantime by another step (see waitForTwin()), then we
+       don't have to build it. */
+    bool fromTwin = !cachedFailure && step->isFixedOutput
+        && store->isValidPath(step->drv.outputs.begin()->second.path);
 
     if (cachedFailure)
         result.status = BuildResult::CachedFailure;
-    else {
+    else if (fromTwin) {
+        printMsg(lvlInfo, format("output of step ‘%1%’ has already been produced by another step") % step->drvPath);
+        result.status = BuildResult::AlreadyValid;
+        res = getBuildOutputCached(store, step->drvPath, &step->drv);
+        nrStepsFromTwins++;
+    } else {
 
         /* Create a build step record indicating that we started
            building. */
@@ -120,18 +165,21 @@ bool State::doBuildStep(std::shared_ptr<StoreAPI> store, Step::ptr step,
         /* Do the build. */
         try {
             /* FIXME: referring builds may have conflicting timeouts. */
-            buildRemote(store, machine, step, build->maxSilentTime, build->buildTimeout, result);
+            buildRemote(store, machine, step, build->maxSilentTime, build->buildTimeout, result, session);
         } catch (Error & e) {
             result.status = BuildResult::MiscFailure;
             result.errorMsg = e.msg();
         }
 
-        if (result.success()) res = getBuildOutput(store, step->drv);
+        if (result.success()) res = getBuildOutputCached(store, step->drvPath, &step->drv);
     }
 
     time_t stepStopTime = time(0);
     if (!result.stopTime) result.stopTime = stepStopTime;
 
+    if (result.status == BuildResult::Built)
+        noteStepDuration(step, result.stopTime - result.startTime);
+
     /* Account the time we spent building this step by dividing it
        among the jobsets that depend on it. */
     {
@@ -214,7 +262,8 @@ bool State::doBuildStep(std::shared_ptr<StoreAPI> store, Step::ptr step,
             {
                 pqxx::work txn(*conn);
 
-                finishBuildStep(txn, result.startTime, result.stopTime, build->id, stepNr, machine->sshName, bssSuccess);
+                if (stepNr)
+                    finishBuildStep(txn, result.startTime, result.stopTime, build->id, stepNr, machine->sshName, bssSuccess);
 
                 for (auto & b : direct)
                     markSucceededBuild(txn, b, res, build != b || result.status != BuildResult::Built,
@@ -392,3 +441,103 @@ bool State::doBuildStep(std::shared_ptr<StoreAPI> store, Step::ptr step,
 
     return false;
 }
+
+
+std::vector<Step::ptr> State::releaseTwins(Step::ptr step)
+{
+    std::vector<Step::ptr> twins;
+
+    auto fixedOutputBuilds_(fixedOutputBuilds.lock());
+    auto i = fixedOutputBuilds_->find(step->drv.outputs.begin()->second.path);
+    if (i == fixedOutputBuilds_->end() || i->second.step.lock() != step) return twins;
+
+    for (auto & twin_ : i->second.twins) {
+        assert(nrTwinsWaiting);
+        nrTwinsWaiting--;
+        auto twin = twin_.lock();
+        if (twin) twins.push_back(twin);
+    }
+
+    fixedOutputBuilds_->erase(i);
+
+    return twins;
+}
+
+
+BuildOutput State::getBuildOutputCached(std::shared_ptr<StoreAPI> store,
+    const Path & drvPath, const Derivation * drv)
+{
+    {
+        auto cache_(buildOutputCache.lock());
+        auto i = cache_->entries.find(drvPath);
+        if (i != cache_->entries.end()) {
+            bool valid = true;
+            for (auto & path : i->second.outputs)
+                if (!store->isValidPath(path)) { valid = false; break; }
+            if (valid) {
+                cache_->lru.splice(cache_->lru.begin(), cache_->lru, i->second.lruPos);
+                nrBuildOutputCacheHits++;
+                return i->second.output;
+            }
+            cache_->lru.erase(i->second.lruPos);
+            cache_->entries.erase(i);
+        }
+    }
+
+    nrBuildOutputCacheMisses++;
+
+    Derivation drv2;
+    if (!drv) {
+        drv2 = readDerivation(drvPath);
+        drv = &drv2;
+    }
+
+    BuildOutput res = getBuildOutput(store, *drv);
+
+    {
+        auto cache_(buildOutputCache.lock());
+        if (cache_->entries.find(drvPath) == cache_->entries.end()) {
+            auto & entry(cache_->entries[drvPath]);
+            entry.outputs = outputPaths(*drv);
+            entry.output = res;
+            cache_->lru.push_front(drvPath);
+            entry.lruPos = cache_->lru.begin();
+            while (cache_->entries.size() > maxCachedBuildOutputs) {
+                cache_->entries.erase(cache_->lru.back());
+                cache_->lru.pop_back();
+            }
+        }
+    }
+
+    return res;
+}
+
+
+/* The name of the derivation of a step, without its version. */
+static std::string stepName(Step::ptr step)
+{
+    std::string name = storePathToName(step->drvPath);
+    if (hasSuffix(name, drvExtension))
+        name = string(name, 0, name.size() - drvExtension.size());
+    return DrvName(name).name;
+}
+
+
+bool State::isShortStep(Step::ptr step, unsigned int maxDuration)
+{
+    auto stepDurations_(stepDurations.lock());
+    auto i = stepDurations_->find(stepName(step));
+    return i != stepDurations_->end() && i->second <= maxDuration;
+}
+
+
+void State::noteStepDuration(Step::ptr step, time_t duration)
+{
+    auto stepDurations_(stepDurations.lock());
+    auto name = stepName(step);
+    auto i = stepDurations_->find(name);
+    if (i == stepDurations_->end())
+        (*stepDurations_)[name] = duration;
+    else
+        i->second = 0.75 * i->second + 0.25 * duration;
+}
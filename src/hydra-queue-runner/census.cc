@@ -0,0 +1,364 @@
+#include <iostream>
+#include <sstream>
+
+#include "state.hh"
+
+#include "util.hh"
+#include "value-to-json.hh"
+
+using namespace nix;
+
+
+/* Estimates of the heap memory used by objects, assuming libstdc++ on
+   a 64-bit platform. They ignore malloc overhead and don't follow
+   shared pointers, so the totals are a lower bound, but they are good
+   enough to see which jobsets or kinds of objects dominate. */
+
+static const size_t treeNodeSize = 32; // colour, parent, left, right
+static const size_t listNodeSize = 16; // next, prev
+static const size_t sharedBlockSize = 16; // make_shared control block
+
+template<typename T> static size_t heapSize(const T & x);
+static size_t heapSize(const std::string & s);
+static size_t heapSize(const DerivationOutput & out);
+static size_t heapSize(const Derivation & drv);
+template<typename T> static size_t heapSize(const std::vector<T> & v);
+template<typename T> static size_t heapSize(const std::list<T> & l);
+template<typename T> static size_t heapSize(const std::set<T> & s);
+template<typename K, typename V> static size_t heapSize(const std::map<K, V> & m);
+template<typename A, typename B> static size_t heapSize(const std::pair<A, B> & p);
+template<typename T> static size_t heapSize(const std::queue<T> & q);
+
+
+template<typename T> static size_t heapSize(const T & x)
+{
+    return 0;
+}
+
+
+static size_t heapSize(const std::string & s)
+{
+    /* Strings of up to 15 characters are stored inline. */
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+
+static size_t heapSize(const DerivationOutput & out)
+{
+    return heapSize(out.path) + heapSize(out.hashAlgo) + heapSize(out.hash);
+}
+
+
+static size_t heapSize(const Derivation & drv)
+{
+    return heapSize(drv.outputs) + heapSize(drv.inputSrcs) + heapSize(drv.platform)
+        + heapSize(drv.builder) + heapSize(drv.args) + heapSize(drv.env)
+        + heapSize(drv.inputDrvs);
+}
+
+
+template<typename T> static size_t heapSize(const std::vector<T> & v)
+{
+    size_t size = v.capacity() * sizeof(T);
+    for (auto & i : v) size += heapSize(i);
+    return size;
+}
+
+
+template<typename T> static size_t heapSize(const std::list<T> & l)
+{
+    size_t size = l.size() * (listNodeSize + sizeof(T));
+    for (auto & i : l) size += heapSize(i);
+    return size;
+}
+
+
+template<typename T> static size_t heapSize(const std::set<T> & s)
+{
+    size_t size = s.size() * (treeNodeSize + sizeof(T));
+    for (auto & i : s) size += heapSize(i);
+    return size;
+}
+
+
+template<typename K, typename V> static size_t heapSize(const std::map<K, V> & m)
+{
+    size_t size = m.size() * (treeNodeSize + sizeof(std::pair<const K, V>));
+    for (auto & i : m) size += heapSize(i.first) + heapSize(i.second);
+    return size;
+}
+
+
+template<typename A, typename B> static size_t heapSize(const std::pair<A, B> & p)
+{
+    return heapSize(p.first) + heapSize(p.second);
+}
+
+
+/* std::queue has no iterators, so this takes a copy. The block
+   overhead of the underlying std::deque is ignored. */
+template<typename T> static size_t heapSize(const std::queue<T> & q)
+{
+    size_t size = q.size() * sizeof(T);
+    for (auto copy(q); !copy.empty(); copy.pop()) size += heapSize(copy.front());
+    return size;
+}
+
+
+/* Object counts and sizes for one jobset or system type. */
+struct CensusEntry
+{
+    size_t nrBuilds = 0, buildBytes = 0;
+    size_t nrSteps = 0, stepBytes = 0, envBytes = 0;
+    size_t nrRunnable = 0;
+
+    void write(std::ostream & out) const
+    {
+        JSONObject obj(out);
+        obj.attr("nrBuilds", nrBuilds);
+        obj.attr("buildBytes", buildBytes);
+        obj.attr("nrSteps", nrSteps);
+        obj.attr("stepBytes", stepBytes);
+        obj.attr("envBytes", envBytes);
+        obj.attr("nrRunnable", nrRunnable);
+    }
+};
+
+
+void State::dumpCensus(Connection & conn)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    std::map<Jobset::ptr, std::string> jobsetNames;
+    std::map<std::string, CensusEntry> byJobset, bySystemType;
+    size_t totalBytes = 0;
+
+    std::ostringstream out;
+
+    {
+        JSONObject root(out);
+        root.attr("time", time(0));
+
+        auto writeCategory = [&](const std::string & name, size_t count, size_t bytes) {
+            root.attr(name);
+            JSONObject nested(out);
+            nested.attr("count", count);
+            nested.attr("bytes", bytes);
+            totalBytes += bytes;
+        };
+
+        /* Jobsets. */
+        {
+            size_t bytes = 0;
+            auto jobsets_(jobsets.lock());
+            for (auto & i : *jobsets_) {
+                auto name = i.first.first + ":" + i.first.second;
+                jobsetNames[i.second] = name;
+                bytes += treeNodeSize + sizeof(*jobsets_->begin()) + heapSize(i.first.first) + heapSize(i.first.second)
+                    + sizeof(Jobset) + sharedBlockSize
+                    + i.second->nrRecentSteps() * (treeNodeSize + sizeof(std::pair<const time_t, time_t>));
+                byJobset[name];
+            }
+            writeCategory("jobsets", jobsets_->size(), bytes);
+        }
+
+        /* Builds. Get the pointers first so that we don't hold the
+           lock while walking them. */
+        std::vector<Build::ptr> builds2;
+        {
+            auto builds_(builds.lock());
+            builds2.reserve(builds_->size());
+            for (auto & i : *builds_) builds2.push_back(i.second);
+            writeCategory("buildsMap", builds_->size(),
+                builds_->size() * (treeNodeSize + sizeof(*builds_->begin())));
+        }
+        {
+            size_t bytes = 0;
+            for (auto & build : builds2) {
+                size_t size = sizeof(Build) + sharedBlockSize + heapSize(build->drvPath)
+                    + heapSize(build->outputs) + heapSize(build->projectName)
+                    + heapSize(build->jobsetName) + heapSize(build->jobName);
+                bytes += size;
+                auto & entry(byJobset[build->projectName + ":" + build->jobsetName]);
+                entry.nrBuilds++;
+                entry.buildBytes += size;
+            }
+            writeCategory("builds", builds2.size(), bytes);
+        }
+        builds2.clear();
+
+        /* Steps. */
+        std::vector<Step::ptr> steps2;
+        {
+            size_t bytes = 0;
+            auto steps_(steps.lock());
+            steps2.reserve(steps_->size());
+            for (auto & i : *steps_) {
+                auto step = i.second.lock();
+                if (step) steps2.push_back(step);
+                bytes += treeNodeSize + sizeof(*steps_->begin()) + heapSize(i.first);
+            }
+            writeCategory("stepsMap", steps_->size(), bytes);
+        }
+        {
+            size_t bytes = 0, drvBytes = 0, envBytes = 0;
+            for (auto & step : steps2) {
+                size_t drvSize = heapSize(step->drv);
+                size_t envSize = heapSize(step->drv.env);
+                size_t size = sizeof(Step) + sharedBlockSize + heapSize(step->drvPath) + drvSize
+                    + heapSize(step->requiredSystemFeatures) + heapSize(step->systemType);
+                std::vector<Jobset::ptr> stepJobsets;
+                {
+                    auto step_(step->state.lock());
+                    size += heapSize(step_->deps) + heapSize(step_->rdeps)
+                        + heapSize(step_->builds) + heapSize(step_->jobsets);
+                    stepJobsets.assign(step_->jobsets.begin(), step_->jobsets.end());
+                }
+                bytes += size;
+                drvBytes += drvSize;
+                envBytes += envSize;
+
+                /* A step shared by several jobsets is counted in
+                   each of them. */
+                for (auto & jobset : stepJobsets) {
+                    auto i = jobsetNames.find(jobset);
+                    if (i == jobsetNames.end()) continue;
+                    auto & entry(byJobset[i->second]);
+                    entry.nrSteps++;
+                    entry.stepBytes += size;
+                    entry.envBytes += envSize;
+                }
+
+                auto & entry(bySystemType[step->systemType]);
+                entry.nrSteps++;
+                entry.stepBytes += size;
+                entry.envBytes += envSize;
+            }
+            writeCategory("steps", steps2.size(), bytes);
+            root.attr("stepDrvBytes", drvBytes);
+            root.attr("stepEnvBytes", envBytes);
+        }
+
+        /* Runnable steps. */
+        {
+            std::vector<Step::ptr> runnable2;
+            {
+                auto runnable_(runnable.lock());
+                for (auto & i : *runnable_) {
+                    auto step = i.lock();
+                    if (step) runnable2.push_back(step);
+                }
+                writeCategory("runnable", runnable_->size(),
+                    runnable_->size() * (listNodeSize + sizeof(Step::wptr)));
+            }
+            for (auto & step : runnable2) {
+                bySystemType[step->systemType].nrRunnable++;
+                std::vector<Jobset::ptr> stepJobsets;
+                {
+                    auto step_(step->state.lock());
+                    stepJobsets.assign(step_->jobsets.begin(), step_->jobsets.end());
+                }
+                for (auto & jobset : stepJobsets) {
+                    auto i = jobsetNames.find(jobset);
+                    if (i != jobsetNames.end()) byJobset[i->second].nrRunnable++;
+                }
+            }
+        }
+        steps2.clear();
+
+        /* Machines. */
+        {
+            size_t bytes = 0;
+            auto machines_(machines.lock());
+            for (auto & i : *machines_) {
+                auto & m(i.second);
+                bytes += treeNodeSize + sizeof(*machines_->begin()) + heapSize(i.first)
+                    + sizeof(Machine) + sharedBlockSize + sizeof(Machine::State) + sharedBlockSize
+                    + heapSize(m->sshName) + heapSize(m->sshKey) + heapSize(m->sshPublicHostKey)
+                    + heapSize(m->systemTypes) + heapSize(m->supportedFeatures)
+                    + heapSize(m->mandatoryFeatures) + heapSize(m->reservedSlots);
+            }
+            writeCategory("machines", machines_->size(), bytes);
+        }
+
+        /* Work queues. */
+        {
+            auto queue_(logCompressorQueue.lock());
+            writeCategory("logCompressorQueue", queue_->size(), heapSize(*queue_));
+        }
+        {
+            auto queue_(binaryCacheQueue.lock());
+            writeCategory("binaryCacheQueue", queue_->size(), heapSize(*queue_));
+        }
+        {
+            auto queue_(notificationSenderQueue.lock());
+            writeCategory("notificationSenderQueue", queue_->size(), heapSize(*queue_));
+        }
+        {
+            auto prefetches_(prefetches.lock());
+            writeCategory("prefetches", prefetches_->size(), heapSize(*prefetches_));
+        }
+        {
+            auto fixedOutputBuilds_(fixedOutputBuilds.lock());
+            writeCategory("fixedOutputBuilds", fixedOutputBuilds_->size(), heapSize(*fixedOutputBuilds_));
+        }
+        {
+            auto cache_(buildOutputCache.lock());
+            size_t bytes = heapSize(cache_->lru);
+            for (auto & i : cache_->entries)
+                bytes += treeNodeSize + sizeof(i) + heapSize(i.first) + heapSize(i.second.outputs)
+                    + heapSize(i.second.output.releaseName)
+                    + i.second.output.products.size() * (listNodeSize + sizeof(BuildProduct))
+                    + heapSize(i.second.output.metrics);
+            writeCategory("buildOutputCache", cache_->entries.size(), bytes);
+        }
+
+        /* The number of live objects, including those no longer
+           reachable from the maps above (e.g. steps kept alive by a
+           running build). */
+        root.attr("live");
+        {
+            JSONObject nested(out);
+            nested.attr("builds", Build::nrLive());
+            nested.attr("steps", Step::nrLive());
+            nested.attr("jobsets", Jobset::nrLive());
+            nested.attr("machines", Machine::nrLive());
+        }
+
+        root.attr("byJobset");
+        {
+            JSONObject nested(out);
+            for (auto & i : byJobset) {
+                nested.attr(i.first);
+                i.second.write(out);
+            }
+        }
+
+        root.attr("bySystemType");
+        {
+            JSONObject nested(out);
+            for (auto & i : bySystemType) {
+                nested.attr(i.first);
+                i.second.write(out);
+            }
+        }
+
+        root.attr("totalBytes", totalBytes);
+        root.attr("censusTimeMs", std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count());
+    }
+
+    lastCensus = time(0);
+    lastCensusBytes = totalBytes;
+
+    printMsg(lvlInfo, format("census: %1% builds, %2% steps, about %3% MiB")
+        % Build::nrLive() % Step::nrLive() % (totalBytes / (1024 * 1024)));
+
+    {
+        pqxx::work txn(conn);
+        txn.exec("delete from SystemStatus where what = 'queue-runner-census'");
+        txn.parameterized("insert into SystemStatus values ('queue-runner-census', $1)")(out.str()).exec();
+        txn.exec("notify census_dumped");
+        txn.commit();
+    }
+}
@@ -10,3 +10,18 @@ struct MaintainCount
     MaintainCount(counter & c) : c(c) { c++; }
     ~MaintainCount() { auto prev = c--; assert(prev); }
 };
+
+/* Keeps track of the number of live instances of a class, for the
+   object census. Classes inherit from InstanceCounter<Class>. */
+template<typename T>
+struct InstanceCounter
+{
+    static counter & nrLive()
+    {
+        static counter n{0};
+        return n;
+    }
+    InstanceCounter() { nrLive()++; }
+    InstanceCounter(const InstanceCounter &) { nrLive()++; }
+    ~InstanceCounter() { nrLive()--; }
+};
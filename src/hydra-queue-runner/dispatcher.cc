@@ -1,12 +1,138 @@
 #include <algorithm>
+#include <queue>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "state.hh"
 
 using namespace nix;
 
 
+/* The runnable steps in dispatch order. Rather than sorting all
+   runnable steps, each jobset gets a heap of its steps, and the
+   jobsets are kept in a heap ordered by the key of their next step
+   and their virtual tag. The order is produced lazily: getting the
+   next step costs O(log J) to pick the jobset plus O(log n) to pop its
+   step, and building the queue is O(n). Since a dispatch pass usually
+   only looks at the first few steps, this is much cheaper than
+   sorting all of them.
+
+   A step that belongs to several jobsets is in the heap of each of
+   them, and is returned on behalf of whichever comes first. */
+class DispatchQueue
+{
+    struct Entry
+    {
+        Step::ptr step;
+        int globalPriority;
+        unsigned int agingLevel;
+        int localPriority;
+        BuildID lowestBuildID;
+    };
+
+    struct JobsetQueue
+    {
+        double tag;
+        bool belowMinimum;
+        std::vector<Entry> heap;
+    };
+
+    std::vector<JobsetQueue> queues;
+    std::map<Jobset::ptr, size_t> queueIndex;
+
+    /* Whether ‘a’ goes before ‘b’ if they're in the same jobset. */
+    static bool before(const Entry & a, const Entry & b)
+    {
+        return
+            a.globalPriority != b.globalPriority ? a.globalPriority > b.globalPriority :
+            a.agingLevel != b.agingLevel ? a.agingLevel > b.agingLevel :
+            a.localPriority != b.localPriority ? a.localPriority > b.localPriority :
+            a.lowestBuildID < b.lowestBuildID;
+    }
+
+    static bool after(const Entry & a, const Entry & b)
+    {
+        return before(b, a);
+    }
+
+    /* Whether the next step of jobset ‘a’ goes before that of ‘b’. */
+    bool jobsetBefore(size_t a, size_t b) const
+    {
+        auto & qa(queues[a]);
+        auto & qb(queues[b]);
+        auto & ea(qa.heap.front());
+        auto & eb(qb.heap.front());
+        return
+            ea.globalPriority != eb.globalPriority ? ea.globalPriority > eb.globalPriority :
+            ea.agingLevel != eb.agingLevel ? ea.agingLevel > eb.agingLevel :
+            qa.belowMinimum != qb.belowMinimum ? qa.belowMinimum :
+            qa.tag != qb.tag ? qa.tag < qb.tag :
+            ea.localPriority != eb.localPriority ? ea.localPriority > eb.localPriority :
+            ea.lowestBuildID < eb.lowestBuildID;
+    }
+
+    struct JobsetAfter
+    {
+        const DispatchQueue * queue;
+        bool operator () (size_t a, size_t b) const { return queue->jobsetBefore(b, a); }
+    };
+
+    std::priority_queue<size_t, std::vector<size_t>, JobsetAfter> jobsetHeap{JobsetAfter{this}};
+    bool started = false;
+
+    std::unordered_set<Step::ptr> returned;
+    std::vector<Step::ptr> ordered;
+
+public:
+
+    DispatchQueue() { }
+    DispatchQueue(const DispatchQueue &) = delete;
+
+    /* Add a step to the queue of ‘jobset’ (which is null for steps
+       that don't belong to any jobset). Must be called before
+       at(). */
+    void add(Jobset::ptr jobset, double tag, bool belowMinimum, Step::ptr step, const Step::State & step_)
+    {
+        assert(!started);
+        auto i = queueIndex.find(jobset);
+        if (i == queueIndex.end()) {
+            i = queueIndex.emplace(jobset, queues.size()).first;
+            queues.push_back({tag, belowMinimum, {}});
+        }
+        queues[i->second].heap.push_back({step, step_.highestGlobalPriority, step_.agingLevel,
+            step_.highestLocalPriority, step_.lowestBuildID});
+    }
+
+    /* Return the step at position ‘n’ in dispatch order, or null if
+       there are fewer steps. */
+    Step::ptr at(size_t n)
+    {
+        if (!started) {
+            started = true;
+            for (size_t i = 0; i < queues.size(); ++i) {
+                auto & heap(queues[i].heap);
+                std::make_heap(heap.begin(), heap.end(), after);
+                jobsetHeap.push(i);
+            }
+        }
+
+        while (ordered.size() <= n && !jobsetHeap.empty()) {
+            size_t i = jobsetHeap.top();
+            jobsetHeap.pop();
+            auto & heap(queues[i].heap);
+            std::pop_heap(heap.begin(), heap.end(), after);
+            auto step = heap.back().step;
+            heap.pop_back();
+            if (!heap.empty()) jobsetHeap.push(i);
+            if (returned.insert(step).second) ordered.push_back(step);
+        }
+
+        return n < ordered.size() ? ordered[n] : 0;
+    }
+};
+
+
 void State::makeRunnable(Step::ptr step)
 {
     printMsg(lvlChatty, format("step ‘%1%’ is now runnable") % step->drvPath);
@@ -33,10 +159,14 @@ void State::dispatcher()
     while (true) {
         printMsg(lvlDebug, "dispatcher woken up");
 
+        auto start = std::chrono::steady_clock::now();
         auto sleepUntil = doDispatch();
+        dispatchTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
 
         /* Sleep until we're woken up (either because a runnable build
            is added, or because a build finishes). */
+        bool woken;
         {
             auto dispatcherWakeup_(dispatcherWakeup.lock());
             if (!*dispatcherWakeup_) {
@@ -45,8 +175,17 @@ void State::dispatcher()
                 dispatcherWakeup_.wait_until(dispatcherWakeupCV, sleepUntil);
             }
             nrDispatcherWakeups++;
-            *dispatcherWakeup_ = false;
+            woken = *dispatcherWakeup_;
         }
+
+        /* Wakeups tend to come in bursts (e.g. when a finished step
+           makes many other steps runnable, or while the queue monitor
+           is loading a large evaluation). So wait a little while to
+           let them accumulate, and handle them in a single pass. */
+        if (woken && dispatcherBatchWindow)
+            std::this_thread::sleep_for(std::chrono::milliseconds(dispatcherBatchWindow));
+
+        *dispatcherWakeup.lock() = false;
     }
 
     printMsg(lvlError, "dispatcher exits");
@@ -65,6 +204,10 @@ system_time State::doDispatch()
             if (s1 != s2)
                 printMsg(lvlDebug, format("pruned scheduling window of ‘%1%:%2%’ from %3% to %4%")
                     % jobset.first.first % jobset.first.second % s1 % s2);
+
+            /* Let jobsets that had no runnable steps in the previous
+               pass become idle. */
+            jobset.second->updateVirtualTag(jobset.second->nrRunnableSteps > 0, virtualTime);
         }
     }
 
@@ -121,39 +264,52 @@ system_time State::doDispatch()
                     a.currentJobs > b.currentJobs;
             });
 
-        /* Sort the runnable steps by priority. Priority is establised
-           as follows (in order of precedence):
+        /* Order the runnable steps by priority. Priority is
+           established as follows (in order of precedence):
 
            - The global priority of the builds that depend on the
              step. This allows admins to bump a build to the front of
              the queue.
 
-           - The lowest used scheduling share of the jobsets depending
-             on the step.
+           - The aging level of the step, i.e. how long it has been
+             runnable (see stepAgingInterval). This prevents steps of
+             busy jobsets from waiting indefinitely while newer steps
+             keep arriving.
+
+           - Whether the jobset of the step runs fewer steps than
+             its guaranteed minimum.
+
+           - The virtual tag of the jobset of the step. The virtual
+             tag is the build time charged to a jobset (including the
+             time of its running steps) divided by its scheduling
+             shares, as in weighted fair queuing. A step that belongs
+             to several jobsets is ordered by the first of them.
 
            - The local priority of the build, as set via the build's
              meta.schedulingPriority field. Note that this is not
              quite correct: the local priority should only be used to
              establish priority between builds in the same jobset, but
              here it's used between steps in different jobsets if they
-             happen to have the same lowest used scheduling share. But
-             that's not every likely.
+             happen to have the same virtual tag. But that's not very
+             likely.
 
            - The lowest ID of the builds depending on the step;
              i.e. older builds take priority over new ones.
 
-           FIXME: O(n lg n); obviously, it would be better to keep a
-           runnable queue sorted by priority. */
-        std::vector<Step::ptr> runnableSorted;
+           See DispatchQueue for how this order is computed. */
+        std::vector<Step::ptr> runnableList;
         struct RunnablePerType
         {
             unsigned int count{0};
             std::chrono::seconds waitTime{0};
+            Step::ptr oldest;
+            system_time oldestSince;
         };
         std::unordered_map<std::string, RunnablePerType> runnablePerType;
+        std::unordered_map<std::string, RunnablePerType> runnablePerFeature;
         {
             auto runnable_(runnable.lock());
-            runnableSorted.reserve(runnable_->size());
+            runnableList.reserve(runnable_->size());
             for (auto i = runnable_->begin(); i != runnable_->end(); ) {
                 auto step = i->lock();
 
@@ -172,7 +328,18 @@ system_time State::doDispatch()
                    to be retried. */
                 {
                     auto step_(step->state.lock());
-                    r.waitTime += std::chrono::duration_cast<std::chrono::seconds>(now - step_->runnableSince);
+                    auto waitTime = std::chrono::duration_cast<std::chrono::seconds>(now - step_->runnableSince);
+                    r.waitTime += waitTime;
+                    if (!r.oldest || step_->runnableSince < r.oldestSince) {
+                        r.oldest = step;
+                        r.oldestSince = step_->runnableSince;
+                    }
+                    step_->agingLevel = agingLevel(waitTime);
+                    for (auto & f : step->requiredSystemFeatures) {
+                        auto & rf = runnablePerFeature[f];
+                        rf.count++;
+                        rf.waitTime += waitTime;
+                    }
                     if (step_->tries > 0 && step_->after > now) {
                         if (step_->after < sleepUntil)
                             sleepUntil = step_->after;
@@ -180,28 +347,37 @@ system_time State::doDispatch()
                     }
                 }
 
-                runnableSorted.push_back(step);
+                runnableList.push_back(step);
             }
         }
 
-        for (auto & step : runnableSorted) {
+        std::map<Jobset::ptr, unsigned int> runnablePerJobset;
+
+        for (auto & step : runnableList) {
             auto step_(step->state.lock());
-            step_->lowestShareUsed = 1e9;
             for (auto & jobset : step_->jobsets)
-                step_->lowestShareUsed = std::min(step_->lowestShareUsed, jobset->shareUsed());
+                runnablePerJobset[jobset]++;
         }
 
-        sort(runnableSorted.begin(), runnableSorted.end(),
-            [](const Step::ptr & a, const Step::ptr & b)
-            {
-                auto a_(a->state.lock());
-                auto b_(b->state.lock()); // FIXME: deadlock?
-                return
-                    a_->highestGlobalPriority != b_->highestGlobalPriority ? a_->highestGlobalPriority > b_->highestGlobalPriority :
-                    a_->lowestShareUsed != b_->lowestShareUsed ? a_->lowestShareUsed < b_->lowestShareUsed :
-                    a_->highestLocalPriority != b_->highestLocalPriority ? a_->highestLocalPriority > b_->highestLocalPriority :
-                    a_->lowestBuildID < b_->lowestBuildID;
-            });
+        /* Get the virtual tags of the backlogged jobsets, and advance
+           the system virtual time to the lowest of them. */
+        std::map<Jobset::ptr, double> virtualTags;
+        double lowestTag = -1;
+        for (auto & i : runnablePerJobset) {
+            double tag = i.first->updateVirtualTag(true, virtualTime);
+            virtualTags[i.first] = tag;
+            if (lowestTag < 0 || tag < lowestTag) lowestTag = tag;
+        }
+        if (lowestTag > virtualTime) virtualTime = lowestTag;
+
+        DispatchQueue order;
+        for (auto & step : runnableList) {
+            auto step_(step->state.lock());
+            if (step_->jobsets.empty())
+                order.add(0, 1e18, false, step, *step_);
+            for (auto & jobset : step_->jobsets)
+                order.add(jobset, virtualTags[jobset], jobset->limit->belowMinimum(), step, *step_);
+        }
 
         /* Find a machine with a free slot and find a step to run
            on it. Once we find such a pair, we restart the outer
@@ -211,33 +387,149 @@ system_time State::doDispatch()
         for (auto & mi : machinesSorted) {
             if (mi.machine->state->currentJobs >= mi.machine->maxJobs) continue;
 
-            for (auto & step : runnableSorted) {
+            /* Whether there is a runnable step that this machine can
+               do that requires a given feature. */
+            std::map<std::string, bool> featureWanted;
+            auto isFeatureWanted = [&](const std::string & feature) -> bool {
+                auto i = featureWanted.find(feature);
+                if (i != featureWanted.end()) return i->second;
+                bool wanted = false;
+                for (auto & step2 : runnableList)
+                    if (step2->requiredSystemFeatures.count(feature) && mi.machine->supportsStep(step2)) {
+                        wanted = true;
+                        break;
+                    }
+                featureWanted[feature] = wanted;
+                return wanted;
+            };
+
+            for (size_t n = 0; ; ++n) {
+                auto step = order.at(n);
+                if (!step) break;
 
                 /* Can this machine do this step? */
                 if (!mi.machine->supportsStep(step)) continue;
 
+                /* Would this step exceed the concurrency limits of
+                   its jobsets? */
+                if (!withinStepLimits(step)) continue;
+
+                /* Is a step with the same fixed output already being
+                   built? */
+                if (waitForTwin(step)) continue;
+
+                /* Does the step fit in the machine's remaining
+                   resource budgets? If not, try a smaller step, unless
+                   this step has been waiting for too long, in which
+                   case we stop filling up the machine to let it
+                   drain. */
+                if (!mi.machine->hasCapacityFor(step)) {
+                    auto step_(step->state.lock());
+                    if (step_->runnableSince + std::chrono::seconds(maxPackingDelay) < now) break;
+                    continue;
+                }
+
+                /* Is there a free slot that this step may use? Slots
+                   reserved for a feature are only lent to other steps
+                   if no runnable step needs the feature, and if the
+                   step is expected to give the slot back soon. */
+                std::string reservedFeature;
+                bool lent;
+                if (!mi.machine->chooseSlot(step,
+                        [&](const std::string & feature) {
+                            return !isFeatureWanted(feature) && isShortStep(step, reservedSlotLendTime);
+                        }, reservedFeature, lent))
+                    continue;
+
+                if (lent) {
+                    printMsg(lvlChatty, format("lending slot reserved for ‘%1%’ on ‘%2%’ to step ‘%3%’")
+                        % reservedFeature % mi.machine->sshName % step->drvPath);
+                    mi.machine->state->nrSlotsLent++;
+                }
+
+                /* If this is a small step, pick other small steps
+                   that this machine can do, to build them one after
+                   another over the same connection. They run in the
+                   cores and memory reserved for this step, so they
+                   must not need more. Since isSmallStep() is not
+                   cheap, only the first few runnable steps are
+                   considered. */
+                std::vector<Step::ptr> batch;
+                if (maxBatchSize > 1 && mi.machine->sshName != "localhost" && isSmallStep(step)) {
+                    PathSet fixedOutputs;
+                    if (step->isFixedOutput) fixedOutputs.insert(step->drv.outputs.begin()->second.path);
+                    auto cores = mi.machine->coresFor(step);
+                    auto memory = mi.machine->memoryFor(step);
+                    size_t maxCandidates = 8 * (size_t) maxBatchSize;
+                    for (size_t n2 = 0; n2 < maxCandidates; ++n2) {
+                        auto step2 = order.at(n2);
+                        if (!step2 || batch.size() + 1 >= maxBatchSize) break;
+                        if (step2 == step || !mi.machine->supportsStep(step2)
+                            || mi.machine->coresFor(step2) > cores
+                            || mi.machine->memoryFor(step2) > memory
+                            || !isSmallStep(step2)
+                            || !withinStepLimits(step2) || waitForTwin(step2)
+                            || (step2->isFixedOutput && !fixedOutputs.insert(step2->drv.outputs.begin()->second.path).second))
+                            continue;
+                        batch.push_back(step2);
+                    }
+                }
+
                 /* Let's do this step. Remove it from the runnable
                    list. FIXME: O(n). */
+                std::vector<Step::ptr> toDispatch{step};
+                toDispatch.insert(toDispatch.end(), batch.begin(), batch.end());
                 {
                     auto runnable_(runnable.lock());
-                    bool removed = false;
-                    for (auto i = runnable_->begin(); i != runnable_->end(); )
-                        if (i->lock() == step) {
+                    std::set<Step::ptr> toRemove(toDispatch.begin(), toDispatch.end());
+                    for (auto i = runnable_->begin(); i != runnable_->end() && !toRemove.empty(); ) {
+                        auto step2 = i->lock();
+                        if (toRemove.erase(step2)) {
                             i = runnable_->erase(i);
-                            removed = true;
-                            break;
+                            auto & r = runnablePerType[step2->systemType];
+                            assert(r.count);
+                            r.count--;
+                            for (auto & f : step2->requiredSystemFeatures)
+                                runnablePerFeature[f].count--;
                         } else ++i;
-                    assert(removed);
-                    auto & r = runnablePerType[step->systemType];
-                    assert(r.count);
-                    r.count--;
+                    }
+                    assert(toRemove.empty());
+                }
+
+                if (!batch.empty()) {
+                    nrBatches++;
+                    nrBatchedSteps += batch.size() + 1;
+                }
+
+                /* Record how long the steps had to wait for a slot
+                   since they became runnable (or retryable). */
+                for (auto & step2 : toDispatch) {
+                    system_time since;
+                    {
+                        auto step_(step2->state.lock());
+                        since = step_->tries > 0 ? std::max(step_->runnableSince, step_->after) : step_->runnableSince;
+                        if (step_->agingLevel) nrAgedStepsDispatched++;
+                    }
+                    auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now() - since).count();
+                    if (latency < 0) latency = 0;
+                    nrStepsDispatched++;
+                    totalDispatchLatencyMs += latency;
+                    if ((unsigned long) latency > maxDispatchLatencyMs) maxDispatchLatencyMs = latency;
+                    if (!step2->requiredSystemFeatures.empty()) {
+                        auto featureStats_(featureStats.lock());
+                        for (auto & f : step2->requiredSystemFeatures) {
+                            auto & fs = (*featureStats_)[f];
+                            fs.nrDispatched++;
+                            fs.totalDispatchLatencyMs += latency;
+                        }
+                    }
                 }
 
                 /* Make a slot reservation and start a thread to
                    do the build. */
-                auto builderThread = std::thread(&State::builder, this,
-                    std::make_shared<MachineReservation>(*this, step, mi.machine));
-                builderThread.detach(); // FIXME?
+                startThread("builder", &State::builder,
+                    std::make_shared<MachineReservation>(*this, step, mi.machine, batch, reservedFeature));
 
                 keepGoing = true;
                 break;
@@ -246,6 +538,39 @@ system_time State::doDispatch()
             if (keepGoing) break;
         }
 
+        /* If no more steps can be started, predict on which machines
+           the steps at the head of the queue will run once slots
+           become available, using the same ordering as above, and let
+           the prefetcher copy their inputs there in the meantime. */
+        if (!keepGoing) {
+            std::map<Machine::ptr, unsigned int> predicted;
+            unsigned int nrPredicted = 0;
+            bool added = false;
+            {
+                auto prefetches_(prefetches.lock());
+                for (size_t n = 0; ; ++n) {
+                    auto step = order.at(n);
+                    if (!step) break;
+                    for (auto & mi : machinesSorted) {
+                        if (mi.machine->sshName == "localhost" || !mi.machine->supportsStep(step)) continue;
+                        auto & n(predicted[mi.machine]);
+                        if (n >= prefetchDepth) continue;
+                        n++;
+                        nrPredicted++;
+                        auto & prefetch((*prefetches_)[step->drvPath]);
+                        if (!prefetch.machine) {
+                            prefetch.step = step;
+                            prefetch.machine = mi.machine;
+                            added = true;
+                        }
+                        break;
+                    }
+                    if (nrPredicted >= machinesSorted.size() * prefetchDepth) break;
+                }
+            }
+            if (added) prefetcherWakeup.notify_one();
+        }
+
         /* Update the stats for the auto-scaler. */
         {
             auto machineTypes_(machineTypes.lock());
@@ -257,6 +582,31 @@ system_time State::doDispatch()
                 auto & j = (*machineTypes_)[i.first];
                 j.runnable = i.second.count;
                 j.waitTime = i.second.waitTime;
+                if (i.second.oldest) {
+                    j.oldestRunnable = i.second.oldest->drvPath;
+                    j.oldestRunnableSince = i.second.oldestSince;
+                }
+            }
+        }
+
+        {
+            auto jobsets_(jobsets.lock());
+            for (auto & i : *jobsets_) {
+                auto j = runnablePerJobset.find(i.second);
+                i.second->nrRunnableSteps = j == runnablePerJobset.end() ? 0 : j->second;
+            }
+        }
+
+        {
+            auto featureStats_(featureStats.lock());
+
+            for (auto & i : *featureStats_)
+                i.second.runnable = 0;
+
+            for (auto & i : runnablePerFeature) {
+                auto & j = (*featureStats_)[i.first];
+                j.runnable = i.second.count;
+                j.waitTime = i.second.waitTime;
             }
         }
 
@@ -268,6 +618,56 @@ system_time State::doDispatch()
 }
 
 
+bool State::withinStepLimits(Step::ptr step)
+{
+    auto step_(step->state.lock());
+    if (step_->jobsets.empty()) return true;
+    for (auto & jobset : step_->jobsets)
+        if (jobset->limit->hasRoom() && (!jobset->projectLimit || jobset->projectLimit->hasRoom()))
+            return true;
+    return false;
+}
+
+
+bool State::waitForTwin(Step::ptr step)
+{
+    if (!step->isFixedOutput) return false;
+
+    {
+        auto fixedOutputBuilds_(fixedOutputBuilds.lock());
+        auto i = fixedOutputBuilds_->find(step->drv.outputs.begin()->second.path);
+        if (i == fixedOutputBuilds_->end()) return false;
+        auto twin = i->second.step.lock();
+        if (!twin || twin == step) return false;
+        for (auto & step2 : i->second.twins)
+            if (step2.lock() == step) return true;
+        printMsg(lvlChatty, format("step ‘%1%’ waits for step ‘%2%’ to produce ‘%3%’")
+            % step->drvPath % twin->drvPath % i->first);
+        i->second.twins.push_back(step);
+        nrTwinsWaiting++;
+    }
+
+    /* Since the step is no longer in the runnable queue, it's kept
+       alive only by its builds. */
+    auto runnable_(runnable.lock());
+    for (auto i = runnable_->begin(); i != runnable_->end(); )
+        if (i->lock() == step) i = runnable_->erase(i); else ++i;
+
+    return true;
+}
+
+
+unsigned int State::agingLevel(std::chrono::seconds waitTime)
+{
+    if (!stepAgingInterval || waitTime.count() < stepAgingInterval) return 0;
+    unsigned long n = waitTime.count() / stepAgingInterval;
+    if (!stepAgingLogarithmic) return n;
+    unsigned int level = 0;
+    for (; n; n >>= 1) level++;
+    return level;
+}
+
+
 void State::wakeDispatcher()
 {
     {
@@ -286,6 +686,62 @@ void Jobset::addStep(time_t startTime, time_t duration)
 }
 
 
+void Jobset::charge(FairShare & fairShare_, system_time now)
+{
+    if (fairShare_.runningWeight > 0) {
+        double seconds = std::chrono::duration<double>(now - fairShare_.lastCharged).count();
+        if (seconds > 0)
+            fairShare_.virtualTag += fairShare_.runningWeight * seconds / shares;
+    }
+    fairShare_.lastCharged = now;
+}
+
+
+double Jobset::updateVirtualTag(bool hasRunnable, double virtualTime)
+{
+    auto fairShare_(fairShare.lock());
+    charge(*fairShare_, std::chrono::system_clock::now());
+    bool backlogged = hasRunnable || fairShare_->runningWeight > 0;
+    if (backlogged && !fairShare_->backlogged)
+        fairShare_->virtualTag = std::max(fairShare_->virtualTag, virtualTime);
+    fairShare_->backlogged = backlogged;
+    return fairShare_->virtualTag;
+}
+
+
+double Jobset::getVirtualTag()
+{
+    auto fairShare_(fairShare.lock());
+    charge(*fairShare_, std::chrono::system_clock::now());
+    return fairShare_->virtualTag;
+}
+
+
+void Jobset::setVirtualTag(double tag)
+{
+    auto fairShare_(fairShare.lock());
+    fairShare_->virtualTag = tag;
+}
+
+
+void Jobset::startRunning(double weight)
+{
+    auto fairShare_(fairShare.lock());
+    charge(*fairShare_, std::chrono::system_clock::now());
+    fairShare_->runningWeight += weight;
+}
+
+
+void Jobset::stopRunning(double weight)
+{
+    auto fairShare_(fairShare.lock());
+    charge(*fairShare_, std::chrono::system_clock::now());
+    fairShare_->runningWeight -= weight;
+    /* Guard against rounding errors. */
+    if (fairShare_->runningWeight < 1e-9) fairShare_->runningWeight = 0;
+}
+
+
 void Jobset::pruneSteps()
 {
     time_t now = time(0);
@@ -299,10 +755,46 @@ void Jobset::pruneSteps()
 }
 
 
-State::MachineReservation::MachineReservation(State & state, Step::ptr step, Machine::ptr machine)
+State::MachineReservation::MachineReservation(State & state, Step::ptr step, Machine::ptr machine,
+    const std::vector<Step::ptr> & batch, const std::string & reservedFeature)
     : state(state), step(step), machine(machine)
+    , cores(machine->coresFor(step)), memory(machine->memoryFor(step))
+    , startTime(time(0)), batch(batch), reservedFeature(reservedFeature)
 {
+    if (reservedFeature != "")
+        (*machine->state->reservedSlotsInUse.lock())[reservedFeature]++;
+
+    /* The slot is charged to the jobsets of the steps that use it,
+       divided equally among the steps and then among their
+       jobsets. */
+    auto addLimits = [&](Step::ptr step) {
+        auto step_(step->state.lock());
+        for (auto & jobset : step_->jobsets) {
+            limits.insert(jobset->limit);
+            if (jobset->projectLimit) limits.insert(jobset->projectLimit);
+            charges[jobset] += 1.0 / (batch.size() + 1) / step_->jobsets.size();
+        }
+    };
+    addLimits(step);
+    for (auto & step2 : batch) addLimits(step2);
+
+    /* Register the fixed-output steps, so that their twins will wait
+       for them. */
+    {
+        auto fixedOutputBuilds_(state.fixedOutputBuilds.lock());
+        auto registerStep = [&](Step::ptr step) {
+            if (step->isFixedOutput)
+                (*fixedOutputBuilds_)[step->drv.outputs.begin()->second.path].step = step;
+        };
+        registerStep(step);
+        for (auto & step2 : batch) registerStep(step2);
+    }
+    for (auto & limit : limits) limit->nrRunning++;
+    for (auto & i : charges) i.first->startRunning(i.second);
+
     machine->state->currentJobs++;
+    machine->state->currentCores += cores;
+    machine->state->currentMemory += memory;
 
     {
         auto machineTypes_(state.machineTypes.lock());
@@ -313,11 +805,24 @@ State::MachineReservation::MachineReservation(State & state, Step::ptr step, Mac
 
 State::MachineReservation::~MachineReservation()
 {
+    if (reservedFeature != "") {
+        auto inUse(machine->state->reservedSlotsInUse.lock());
+        assert((*inUse)[reservedFeature]);
+        (*inUse)[reservedFeature]--;
+    }
+
+    for (auto & limit : limits) limit->nrRunning--;
+    for (auto & i : charges) i.first->stopRunning(i.second);
+
     auto prev = machine->state->currentJobs--;
     assert(prev);
     if (prev == 1)
         machine->state->idleSince = time(0);
 
+    machine->state->currentCores -= cores;
+    machine->state->currentMemory -= memory;
+    machine->state->totalCoreTime += cores * (time(0) - startTime);
+
     {
         auto machineTypes_(state.machineTypes.lock());
         auto & machineType = (*machineTypes_)[step->systemType];
@@ -7,6 +7,7 @@
 
 #include "state.hh"
 #include "build-result.hh"
+#include "hydra-config.hh"
 
 #include "shared.hh"
 #include "globals.hh"
@@ -21,6 +22,39 @@ State::State()
     if (hydraData == "") throw Error("$HYDRA_DATA must be set");
 
     logDir = canonPath(hydraData + "/build-logs");
+
+    stepGraphDir = canonPath(hydraData + "/step-graphs");
+
+    hydraConfig = getHydraConfig();
+
+    if (hydraConfig["binary_cache_dir"] != "")
+        binaryCacheDir = canonPath(hydraConfig["binary_cache_dir"]);
+
+    if (hydraConfig["dispatcher_batch_window"] != "")
+        string2Int(hydraConfig["dispatcher_batch_window"], dispatcherBatchWindow);
+
+    if (hydraConfig["reserved_slot_lend_time"] != "")
+        string2Int(hydraConfig["reserved_slot_lend_time"], reservedSlotLendTime);
+
+    if (hydraConfig["log_archive_age"] != "")
+        string2Int(hydraConfig["log_archive_age"], logArchiveAge);
+
+    haveReplica = getEnv("HYDRA_DBI_RO") != "";
+    if (hydraConfig["max_replica_lag"] != "")
+        string2Int(hydraConfig["max_replica_lag"], maxReplicaLag);
+
+    if (hydraConfig["max_batch_size"] != "")
+        string2Int(hydraConfig["max_batch_size"], maxBatchSize);
+    if (hydraConfig["batch_step_max_duration"] != "")
+        string2Int(hydraConfig["batch_step_max_duration"], batchStepMaxDuration);
+
+    if (hydraConfig["step_aging_interval"] != "")
+        string2Int(hydraConfig["step_aging_interval"], stepAgingInterval);
+    auto stepAging = hydraConfig["step_aging"];
+    if (stepAging == "logarithmic")
+        stepAgingLogarithmic = true;
+    else if (stepAging != "" && stepAging != "linear")
+        throw Error(format("invalid value ‘%1%’ for ‘step_aging’ in hydra.conf") % stepAging);
 }
 
 
@@ -36,7 +70,7 @@ void State::parseMachines(const std::string & contents)
         line = trim(string(line, 0, line.find('#')));
         auto tokens = tokenizeString<std::vector<std::string>>(line);
         if (tokens.size() < 3) continue;
-        tokens.resize(8);
+        tokens.resize(9);
 
         auto machine = std::make_shared<Machine>();
         machine->sshName = tokens[0];
@@ -56,6 +90,36 @@ void State::parseMachines(const std::string & contents)
         if (tokens[7] != "" && tokens[7] != "-")
             machine->sshPublicHostKey = base64Decode(tokens[7]);
 
+        /* Hydra-specific options, given as a comma-separated list of
+           ‘name=value’ pairs. Nix ignores this column. */
+        if (tokens[8] == "-") tokens[8] = "";
+        for (auto & option : tokenizeString<Strings>(tokens[8], ",")) {
+            auto eq = option.find('=');
+            string name = string(option, 0, eq);
+            string value = eq == string::npos ? "1" : string(option, eq + 1);
+            if (name == "substitute")
+                machine->useSubstitutes = value == "1" || value == "true";
+            else if (name == "cores")
+                string2Int(value, machine->cores);
+            else if (name == "memory")
+                string2Int(value, machine->memory);
+            else if (string(name, 0, 8) == "reserve:") {
+                string feature(name, 8);
+                if (machine->supportedFeatures.find(feature) == machine->supportedFeatures.end())
+                    printMsg(lvlError, format("machine ‘%1%’ reserves slots for unsupported feature ‘%2%’")
+                        % machine->sshName % feature);
+                else
+                    string2Int(value, machine->reservedSlots[feature]);
+            }
+            else
+                printMsg(lvlError, format("unknown option ‘%1%’ for machine ‘%2%’") % name % machine->sshName);
+        }
+
+        unsigned int reserved = 0;
+        for (auto & i : machine->reservedSlots) reserved += i.second;
+        if (reserved > machine->maxJobs)
+            printMsg(lvlError, format("machine ‘%1%’ reserves more slots than it has") % machine->sshName);
+
         /* Re-use the State object of the previous machine with the
            same name. */
         auto i = oldMachines.find(machine->sshName);
@@ -366,6 +430,77 @@ bool State::checkCachedFailure(Step::ptr step, Connection & conn)
 }
 
 
+State::ReadOnlyConnection State::getReadOnlyConnection()
+{
+    ReadOnlyConnection conn;
+
+    if (haveReplica) {
+        time_t now = time(0);
+        ReplicaStatus status(*replicaStatus.lock());
+        bool check = status.lastCheck + replicaLagCheckInterval <= now;
+
+        if (check || (status.up && status.lag <= maxReplicaLag)) {
+            try {
+                conn.replica = std::unique_ptr<Pool<ReplicaConnection>::Handle>(
+                    new Pool<ReplicaConnection>::Handle(dbReplicaPool.get()));
+
+                /* Determine how far the replica is behind. It's up to
+                   date if it has replayed the WAL up to the primary's
+                   current position. Otherwise, its lag is the age of
+                   the last transaction it replayed; if it hasn't
+                   replayed any (e.g. because it's not connected to
+                   the primary), it's not usable. A server that is not
+                   in recovery is not a replica, so it's always up to
+                   date. */
+                if (check) {
+                    std::string primaryLocation;
+                    {
+                        auto primary(dbPool.get());
+                        pqxx::nontransaction txn(*primary);
+                        primaryLocation = txn.exec("select pg_current_xlog_location()")[0][0].as<std::string>();
+                    }
+
+                    pqxx::nontransaction txn(*conn);
+                    auto res = txn.parameterized
+                        ("select pg_is_in_recovery(), "
+                         "coalesce(pg_xlog_location_diff($1, pg_last_xlog_replay_location()) <= 0, false), "
+                         "extract(epoch from now() - pg_last_xact_replay_timestamp())")
+                        (primaryLocation).exec();
+                    status.up = true;
+                    if (!res[0][0].as<bool>() || res[0][1].as<bool>())
+                        status.lag = 0;
+                    else if (res[0][2].is_null())
+                        status.lag = std::numeric_limits<double>::infinity();
+                    else
+                        status.lag = std::max(res[0][2].as<double>(), 0.0);
+                    status.lastCheck = now;
+                    *replicaStatus.lock() = status;
+                }
+            } catch (std::exception & e) {
+                printMsg(lvlError, format("cannot use the database replica: %1%") % e.what());
+                conn.replica.reset();
+                status.up = false;
+                status.lastCheck = now;
+                *replicaStatus.lock() = status;
+            }
+        }
+
+        if (conn.replica && status.lag > maxReplicaLag) {
+            printMsg(lvlDebug, format("database replica is %1%s behind, using the primary") % status.lag);
+            conn.replica.reset();
+        }
+
+        if (conn.replica) nrReplicaQueries++; else nrReplicaFallbacks++;
+    }
+
+    if (!conn.replica)
+        conn.primary = std::unique_ptr<Pool<Connection>::Handle>(
+            new Pool<Connection>::Handle(dbPool.get()));
+
+    return conn;
+}
+
+
 void State::logCompressor()
 {
     while (true) {
@@ -468,6 +603,52 @@ std::shared_ptr<PathLocks> State::acquireGlobalLock()
 }
 
 
+bool State::acquireAdvisoryLock()
+{
+    auto setting = hydraConfig["queue_runner_advisory_lock"];
+    if (setting != "1" && setting != "true") return true;
+
+    if (!advisoryLockConn) advisoryLockConn = std::make_shared<Connection>();
+
+    pqxx::work txn(*advisoryLockConn);
+    auto res = txn.parameterized("select pg_try_advisory_lock($1)")(advisoryLockKey).exec();
+    txn.commit();
+
+    return res[0][0].as<bool>();
+}
+
+
+void State::monitorAdvisoryLock()
+{
+    while (true) {
+        sleep(advisoryLockCheckInterval);
+
+        /* Note: if the connection was lost, pqxx reconnects
+           transparently, but the new session doesn't hold the
+           lock. So check for the lock rather than the connection. */
+        bool held = false;
+        try {
+            pqxx::work txn(*advisoryLockConn);
+            auto res = txn.parameterized
+                ("select exists (select 1 from pg_locks where locktype = 'advisory' and granted and pid = pg_backend_pid() "
+                 "and ((classid::bigint << 32) | objid::bigint) = $1)")
+                (advisoryLockKey).exec();
+            held = res[0][0].as<bool>();
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("checking the advisory lock: %1%") % e.what());
+        }
+
+        if (!held) {
+            /* Another queue runner may already have taken over, so
+               stop right away, without running any destructors that
+               could still write to the database. */
+            printMsg(lvlError, "lost the advisory lock; exiting");
+            _exit(1);
+        }
+    }
+}
+
+
 void State::dumpStatus(Connection & conn, bool log)
 {
     std::ostringstream out;
@@ -503,6 +684,7 @@ void State::dumpStatus(Connection & conn, bool log)
         root.attr("bytesSent"); out << bytesSent;
         root.attr("bytesReceived"); out << bytesReceived;
         root.attr("nrBuildsRead", nrBuildsRead);
+        root.attr("nrStepsFromStepGraph", nrStepsFromStepGraph);
         root.attr("nrBuildsDone", nrBuildsDone);
         root.attr("nrStepsDone", nrStepsDone);
         root.attr("nrRetries", nrRetries);
@@ -513,9 +695,106 @@ void State::dumpStatus(Connection & conn, bool log)
             root.attr("avgStepTime"); out << (float) totalStepTime / nrStepsDone;
             root.attr("avgStepBuildTime"); out << (float) totalStepBuildTime / nrStepsDone;
         }
+        root.attr("nrBatches", nrBatches);
+        root.attr("nrBatchedSteps", nrBatchedSteps);
+        root.attr("nrPrefetches", nrPrefetches);
+        root.attr("nrPrefetchesFailed", nrPrefetchesFailed);
+        root.attr("nrPrefetchesAborted", nrPrefetchesAborted);
+        root.attr("nrPrefetchHits", nrPrefetchHits);
+        root.attr("nrPrefetchMisses", nrPrefetchMisses);
+        if (nrPrefetchHits + nrPrefetchMisses) {
+            root.attr("prefetchHitRate");
+            out << (float) nrPrefetchHits / (nrPrefetchHits + nrPrefetchMisses);
+        }
+        root.attr("bytesPrefetched"); out << bytesPrefetched;
+        root.attr("bytesPrefetchWasted"); out << bytesPrefetchWasted;
+        if (binaryCacheDir != "") {
+            root.attr("binaryCache");
+            JSONObject nested(out);
+            {
+                auto binaryCacheQueue_(binaryCacheQueue.lock());
+                nested.attr("backlog", binaryCacheQueue_->size());
+            }
+            nested.attr("backlogBytes"); out << binaryCacheBacklogBytes;
+            nested.attr("nrNarsWritten", nrNarsWritten);
+            nested.attr("bytesNarsWritten"); out << bytesNarsWritten;
+            nested.attr("bytesNarsCompressed"); out << bytesNarsCompressed;
+            nested.attr("totalNarWriteTimeMs", totalNarWriteTimeMs);
+            if (totalNarWriteTimeMs) {
+                nested.attr("throughput");
+                out << (double) bytesNarsWritten * 1000 / totalNarWriteTimeMs;
+            }
+        }
+        if (logArchiveAge) {
+            root.attr("nrLogsArchived", nrLogsArchived);
+            root.attr("bytesLogsArchived"); out << bytesLogsArchived;
+        }
+        root.attr("nrTwinsWaiting", nrTwinsWaiting);
+        root.attr("nrStepsFromTwins", nrStepsFromTwins);
+        root.attr("nrBuildOutputCacheHits", nrBuildOutputCacheHits);
+        root.attr("nrBuildOutputCacheMisses", nrBuildOutputCacheMisses);
+        {
+            root.attr("threadRoles");
+            JSONObject nested(out);
+            for (auto & i : threadRoles.sample()) {
+                nested.attr(i.first);
+                JSONObject nested2(out);
+                auto & total(i.second.total);
+                auto & recent(i.second.recent);
+                nested2.attr("nrThreads", total.nrThreads);
+                nested2.attr("cpuTime"); out << total.cpuTime;
+                nested2.attr("wallTime"); out << total.wallTime;
+                if (recent.wallTime > 0) {
+                    double utilisation = std::min(recent.cpuTime / recent.wallTime, 1.0);
+                    nested2.attr("cpuUtilisation"); out << utilisation;
+                    nested2.attr("blockedFraction"); out << 1.0 - utilisation;
+                }
+            }
+        }
         root.attr("nrQueueWakeups", nrQueueWakeups);
         root.attr("nrDispatcherWakeups", nrDispatcherWakeups);
+        root.attr("dispatcherBatchWindow", dispatcherBatchWindow);
+        root.attr("nrStepsDispatched", nrStepsDispatched);
+        if (nrStepsDispatched) {
+            root.attr("avgDispatchLatencyMs"); out << (float) totalDispatchLatencyMs / nrStepsDispatched;
+            root.attr("dispatcherWakeupsPerStep"); out << (float) nrDispatcherWakeups / nrStepsDispatched;
+        }
+        root.attr("maxDispatchLatencyMs", maxDispatchLatencyMs);
+        if (stepAgingInterval) {
+            root.attr("stepAgingInterval", stepAgingInterval);
+            root.attr("nrAgedStepsDispatched", nrAgedStepsDispatched);
+        }
+        root.attr("dispatchTimeMs", dispatchTimeMs);
+        if (nrDispatcherWakeups) {
+            root.attr("avgDispatchTimeMs"); out << (float) dispatchTimeMs / nrDispatcherWakeups;
+        }
+        root.attr("virtualTime"); out << (double) virtualTime;
         root.attr("nrDbConnections", dbPool.count());
+        {
+            root.attr("census");
+            JSONObject nested(out);
+            nested.attr("nrLiveBuilds", Build::nrLive());
+            nested.attr("nrLiveSteps", Step::nrLive());
+            nested.attr("nrLiveJobsets", Jobset::nrLive());
+            nested.attr("nrLiveMachines", Machine::nrLive());
+            nested.attr("logCompressorBacklog", logCompressorQueue.lock()->size());
+            nested.attr("notificationBacklog", notificationSenderQueue.lock()->size());
+            nested.attr("nrPendingPrefetches", prefetches.lock()->size());
+            if (lastCensus) {
+                nested.attr("lastCensus", lastCensus);
+                nested.attr("lastCensusBytes", lastCensusBytes);
+            }
+        }
+        if (haveReplica) {
+            root.attr("replica");
+            JSONObject nested(out);
+            auto replicaStatus_(replicaStatus.lock());
+            nested.attr("up", replicaStatus_->up);
+            nested.attr("lag"); out << replicaStatus_->lag;
+            nested.attr("nrDbConnections", dbReplicaPool.count());
+            nested.attr("nrQueries", nrReplicaQueries);
+            nested.attr("nrFallbacks", nrReplicaFallbacks);
+        }
         {
             root.attr("machines");
             JSONObject nested(out);
@@ -536,6 +815,32 @@ void State::dumpStatus(Connection & conn, bool log)
                     nested2.attr("avgStepTime"); out << (float) s->totalStepTime / s->nrStepsDone;
                     nested2.attr("avgStepBuildTime"); out << (float) s->totalStepBuildTime / s->nrStepsDone;
                 }
+                if (m->cores) {
+                    nested2.attr("cores", m->cores);
+                    nested2.attr("currentCores", s->currentCores);
+                    nested2.attr("totalCoreTime", s->totalCoreTime);
+                }
+                if (m->memory) {
+                    nested2.attr("memory", m->memory);
+                    nested2.attr("currentMemory", s->currentMemory);
+                }
+                if (!m->reservedSlots.empty()) {
+                    nested2.attr("nrSlotsLent", s->nrSlotsLent);
+                    nested2.attr("reservedSlots");
+                    JSONObject nested3(out);
+                    auto inUse(s->reservedSlotsInUse.lock());
+                    for (auto & i : m->reservedSlots) {
+                        nested3.attr(i.first);
+                        JSONObject nested4(out);
+                        nested4.attr("reserved", i.second);
+                        nested4.attr("inUse", (*inUse)[i.first]);
+                    }
+                }
+                if (m->useSubstitutes) {
+                    nested2.attr("nrPathsSubstituted", s->nrPathsSubstituted);
+                    nested2.attr("bytesSubstituted"); out << s->bytesSubstituted;
+                    nested2.attr("totalSubstitutionTimeMs", s->totalSubstitutionTimeMs);
+                }
             }
         }
         {
@@ -547,6 +852,24 @@ void State::dumpStatus(Connection & conn, bool log)
                 JSONObject nested2(out);
                 nested2.attr("shareUsed"); out << jobset.second->shareUsed();
                 nested2.attr("seconds", jobset.second->getSeconds());
+                nested2.attr("virtualTag"); out << jobset.second->getVirtualTag();
+                nested2.attr("nrRunningSteps", jobset.second->limit->nrRunning);
+                nested2.attr("nrRunnableSteps", jobset.second->nrRunnableSteps);
+                if (jobset.second->limit->maxSteps)
+                    nested2.attr("maxSteps", jobset.second->limit->maxSteps);
+                if (jobset.second->limit->minSteps)
+                    nested2.attr("minSteps", jobset.second->limit->minSteps);
+            }
+        }
+        {
+            root.attr("projects");
+            JSONObject nested(out);
+            auto projectLimits_(projectLimits.lock());
+            for (auto & i : *projectLimits_) {
+                nested.attr(i.first);
+                JSONObject nested2(out);
+                nested2.attr("nrRunningSteps", i.second->nrRunning);
+                nested2.attr("maxSteps", i.second->maxSteps);
             }
         }
         {
@@ -558,13 +881,34 @@ void State::dumpStatus(Connection & conn, bool log)
                 JSONObject nested2(out);
                 nested2.attr("runnable", i.second.runnable);
                 nested2.attr("running", i.second.running);
-                if (i.second.runnable > 0)
+                if (i.second.runnable > 0) {
                     nested2.attr("waitTime", i.second.waitTime.count() +
                         i.second.runnable * (time(0) - lastDispatcherCheck));
+                    nested2.attr("oldestRunnableStep", i.second.oldestRunnable);
+                    nested2.attr("oldestRunnableSince", std::chrono::system_clock::to_time_t(i.second.oldestRunnableSince));
+                }
                 if (i.second.running == 0)
                     nested2.attr("lastActive", std::chrono::system_clock::to_time_t(i.second.lastActive));
             }
         }
+        {
+            root.attr("features");
+            JSONObject nested(out);
+            auto featureStats_(featureStats.lock());
+            for (auto & i : *featureStats_) {
+                nested.attr(i.first);
+                JSONObject nested2(out);
+                nested2.attr("runnable", i.second.runnable);
+                if (i.second.runnable > 0)
+                    nested2.attr("waitTime", i.second.waitTime.count() +
+                        i.second.runnable * (time(0) - lastDispatcherCheck));
+                nested2.attr("nrDispatched", i.second.nrDispatched);
+                if (i.second.nrDispatched) {
+                    nested2.attr("avgDispatchLatencyMs");
+                    out << (float) i.second.totalDispatchLatencyMs / i.second.nrDispatched;
+                }
+            }
+        }
     }
 
     if (log) printMsg(lvlInfo, format("status: %1%") % out.str());
@@ -580,38 +924,43 @@ void State::dumpStatus(Connection & conn, bool log)
 }
 
 
-void State::showStatus()
+void State::showStatus(bool census)
 {
+    std::string what = census ? "queue-runner-census" : "queue-runner";
+
     auto conn(dbPool.get());
-    receiver statusDumped(*conn, "status_dumped");
+    receiver statusDumped(*conn, census ? "census_dumped" : "status_dumped");
 
     string status;
     bool barf = false;
 
     /* Get the last JSON status dump from the database. */
     {
-        pqxx::work txn(*conn);
+        auto conn2(getReadOnlyConnection());
+        pqxx::work txn(*conn2);
         auto res = txn.exec("select status from SystemStatus where what = 'queue-runner'");
         if (res.size()) status = res[0][0].as<string>();
     }
 
     if (status != "") {
+        status = "";
 
         /* If the status is not empty, then the queue runner is
            running. Ask it to update the status dump. */
         {
             pqxx::work txn(*conn);
-            txn.exec("notify dump_status");
+            txn.exec(census ? "notify dump_census" : "notify dump_status");
             txn.commit();
         }
 
         /* Wait until it has done so. */
         barf = conn->await_notification(5, 0) == 0;
 
-        /* Get the new status. */
+        /* Get the new status. This has to come from the primary,
+           since the replica may not have the new dump yet. */
         {
             pqxx::work txn(*conn);
-            auto res = txn.exec("select status from SystemStatus where what = 'queue-runner'");
+            auto res = txn.parameterized("select status from SystemStatus where what = $1")(what).exec();
             if (res.size()) status = res[0][0].as<string>();
         }
 
@@ -644,43 +993,127 @@ void State::unlock()
 }
 
 
-void State::run(BuildID buildOne)
+void State::run(BuildID buildOne, bool standbyMode)
 {
     startedAt = time(0);
     this->buildOne = buildOne;
 
-    auto lock = acquireGlobalLock();
-    if (!lock)
-        throw Error("hydra-queue-runner is already running");
+    ThreadRoles::Registration role(threadRoles, "main");
+
+    std::shared_ptr<PathLocks> lock;
+
+    if (standbyMode) {
+
+        /* Load the queue and keep it up to date while waiting for
+           the active queue runner to go away. */
+        printMsg(lvlInfo, "starting in standby mode");
+        standby = true;
+
+        startThread("machines-monitor", &State::monitorMachinesFile);
+
+        startThread("queue-monitor", &State::queueMonitor);
+
+        while (true) {
+            lock = acquireGlobalLock();
+            if (lock && acquireAdvisoryLock()) break;
+            lock = 0;
+            sleep(standbyPollInterval);
+        }
+
+        printMsg(lvlError, "taking over as the active queue runner");
+        standby = false;
+
+    } else {
+        lock = acquireGlobalLock();
+        if (!lock || !acquireAdvisoryLock())
+            throw Error("hydra-queue-runner is already running");
+    }
+
+    if (advisoryLockConn)
+        startThread("advisory-lock-monitor", &State::monitorAdvisoryLock);
 
     {
         auto conn(dbPool.get());
         clearBusy(*conn, 0);
         dumpStatus(*conn, false);
+
+        /* Drop the builds that the previous queue runner finished
+           while we were in standby, and the steps that it built. Make
+           the queue monitor re-read the queue, to pick up the builds
+           that it skipped. This must happen before the dispatcher
+           starts, since it would otherwise build those steps
+           again. */
+        if (standbyMode) {
+            processQueueChange(*conn);
+            revalidateSteps();
+            rescanQueue = true;
+            pqxx::work txn(*conn);
+            txn.exec("notify builds_added");
+            txn.commit();
+        }
     }
 
-    std::thread(&State::monitorMachinesFile, this).detach();
+    /* Set up the binary cache. Spool files left behind by a previous
+       instance (e.g. one that crashed) will never be processed, so
+       delete them. This must happen before the dispatcher starts,
+       since spool files are created as soon as steps finish. */
+    if (binaryCacheDir != "") {
+        createDirs(binaryCacheDir + "/nar");
+        Path tmpDir = binaryCacheDir + "/tmp";
+        createDirs(tmpDir);
+        unsigned int nrLeftovers = 0;
+        for (auto & i : readDirectory(tmpDir)) {
+            deletePath(tmpDir + "/" + i.name);
+            nrLeftovers++;
+        }
+        if (nrLeftovers)
+            printMsg(lvlInfo, format("deleted %1% leftover files from ‘%2%’") % nrLeftovers % tmpDir);
+        if (!pathExists(binaryCacheDir + "/nix-cache-info"))
+            writeFile(binaryCacheDir + "/nix-cache-info", "StoreDir: " + settings.nixStore + "\n");
+    }
+
+    if (!standbyMode) {
+        startThread("machines-monitor", &State::monitorMachinesFile);
 
-    std::thread(&State::queueMonitor, this).detach();
+        startThread("queue-monitor", &State::queueMonitor);
+    }
 
-    std::thread(&State::dispatcher, this).detach();
+    startThread("dispatcher", &State::dispatcher);
 
     /* Run a log compressor thread. If needed, we could start more
        than one. */
-    std::thread(&State::logCompressor, this).detach();
+    startThread("log-compressor", &State::logCompressor);
+
+    if (logArchiveAge)
+        startThread("log-archiver", &State::logArchiver);
 
     /* Idem for notification sending. */
-    std::thread(&State::notificationSender, this).detach();
+    startThread("notification-sender", &State::notificationSender);
+
+    startThread("prefetcher", &State::prefetcher);
+
+    /* Start the binary cache writers. */
+    if (binaryCacheDir != "") {
+        unsigned int nrWriters = 4;
+        if (hydraConfig["binary_cache_threads"] != "")
+            string2Int(hydraConfig["binary_cache_threads"], nrWriters);
+        for (unsigned int n = 0; n < nrWriters; ++n)
+            startThread("binary-cache-writer", &State::binaryCacheWriter);
+    }
 
-    /* Monitor the database for status dump requests (e.g. from
-       ‘hydra-queue-runner --status’). */
+    /* Monitor the database for status dump and census requests
+       (e.g. from ‘hydra-queue-runner --status’). */
     while (true) {
         try {
             auto conn(dbPool.get());
             receiver dumpStatus(*conn, "dump_status");
+            receiver dumpCensus(*conn, "dump_census");
             while (true) {
                 bool timeout = conn->await_notification(300, 0) == 0;
-                State::dumpStatus(*conn, timeout);
+                if (dumpCensus.get())
+                    State::dumpCensus(*conn);
+                if (timeout || dumpStatus.get())
+                    State::dumpStatus(*conn, timeout);
             }
         } catch (std::exception & e) {
             printMsg(lvlError, format("main thread: %1%") % e.what());
@@ -701,6 +1134,8 @@ int main(int argc, char * * argv)
 
         bool unlock = false;
         bool status = false;
+        bool census = false;
+        bool standby = false;
         BuildID buildOne = 0;
 
         parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
@@ -708,6 +1143,10 @@ int main(int argc, char * * argv)
                 unlock = true;
             else if (*arg == "--status")
                 status = true;
+            else if (*arg == "--census")
+                census = true;
+            else if (*arg == "--standby")
+                standby = true;
             else if (*arg == "--build-one") {
                 if (!string2Int<BuildID>(getArg(*arg, arg, end), buildOne))
                     throw Error("‘--build-one’ requires a build ID");
@@ -720,11 +1159,11 @@ int main(int argc, char * * argv)
         settings.lockCPU = false;
 
         State state;
-        if (status)
-            state.showStatus();
+        if (status || census)
+            state.showStatus(census);
         else if (unlock)
             state.unlock();
         else
-            state.run(buildOne);
+            state.run(buildOne, standby);
     });
 }
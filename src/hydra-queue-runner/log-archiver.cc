@@ -0,0 +1,196 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "state.hh"
+
+#include "util.hh"
+
+using namespace nix;
+
+
+/* Packed log archives live in ‘build-logs/packs/<xx>/’, where <xx> is
+   the same two-character bucket as for loose logs. Each pack
+   ‘<n>.pack’ is a concatenation of bzip2-compressed logs and is only
+   ever appended to. The corresponding index ‘<n>.idx’ is a sorted
+   list of fixed-size records
+
+     <drv hash> <offset> <length>\n
+
+   with the offset and length in hexadecimal, so that readers can
+   binary-search it. The index is replaced atomically after the pack
+   has been appended to, so readers never see entries that refer to
+   incomplete data. */
+
+
+static const size_t logIndexRecordSize = 64;
+
+
+typedef std::map<std::string, std::pair<off_t, off_t>> LogIndex;
+
+
+static LogIndex readLogIndex(const Path & indexFile)
+{
+    LogIndex index;
+    if (!pathExists(indexFile)) return index;
+    string s = readFile(indexFile);
+    if (s.size() % logIndexRecordSize != 0)
+        throw Error(format("log index ‘%1%’ is corrupt") % indexFile);
+    for (size_t pos = 0; pos < s.size(); pos += logIndexRecordSize) {
+        auto fields = tokenizeString<Strings>(string(s, pos, logIndexRecordSize), " \n");
+        if (fields.size() != 3)
+            throw Error(format("log index ‘%1%’ is corrupt") % indexFile);
+        auto i = fields.begin();
+        auto hash = *i++;
+        off_t offset = std::stoll(*i++, 0, 16);
+        off_t length = std::stoll(*i++, 0, 16);
+        index[hash] = {offset, length};
+    }
+    return index;
+}
+
+
+static void writeLogIndex(const Path & indexFile, const LogIndex & index)
+{
+    string s;
+    s.reserve(index.size() * logIndexRecordSize);
+    for (auto & i : index)
+        s += (format("%1% %2$015x %3$014x\n") % i.first % i.second.first % i.second.second).str();
+    assert(s.size() == index.size() * logIndexRecordSize);
+
+    Path tmpFile = indexFile + ".tmp";
+    AutoCloseFD fd = open(tmpFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) throw SysError(format("creating ‘%1%’") % tmpFile);
+    writeFull(fd, s);
+    if (fsync(fd) == -1) throw SysError(format("syncing ‘%1%’") % tmpFile);
+    fd.close();
+
+    if (rename(tmpFile.c_str(), indexFile.c_str()) == -1)
+        throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmpFile % indexFile);
+}
+
+
+/* Append the contents of ‘path’ to ‘fd’ through a fixed-size
+   buffer, and return the number of bytes copied. */
+static off_t appendFile(const Path & path, int fd)
+{
+    AutoCloseFD from(open(path.c_str(), O_RDONLY));
+    if (from == -1) throw SysError(format("opening ‘%1%’") % path);
+
+    std::vector<unsigned char> buf(65536);
+    off_t size = 0;
+
+    while (true) {
+        checkInterrupt();
+        ssize_t n = read(from, buf.data(), buf.size());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError(format("reading ‘%1%’") % path);
+        }
+        if (n == 0) break;
+        writeFull(fd, buf.data(), n);
+        size += n;
+    }
+
+    return size;
+}
+
+
+void State::logArchiver()
+{
+    while (true) {
+        try {
+            time_t cutoff = time(0) - logArchiveAge * 24 * 60 * 60;
+
+            for (auto & i : readDirectory(logDir))
+                if (i.name.size() == 2)
+                    archiveLogs(i.name, cutoff);
+
+        } catch (std::exception & e) {
+            printMsg(lvlError, format("log archiver: %1%") % e.what());
+        }
+
+        sleep(logArchiveInterval);
+    }
+}
+
+
+void State::archiveLogs(const std::string & bucket, time_t cutoff)
+{
+    Path dir = logDir + "/" + bucket;
+    Path packDir = logDir + "/packs/" + bucket;
+
+    /* Find the compressed logs in this bucket that haven't been
+       touched since the cutoff, keyed by the hash part of their
+       derivation. Uncompressed logs may still be in use, so we leave
+       them alone. */
+    std::map<std::string, Path> logs;
+    for (auto & i : readDirectory(dir)) {
+        if (!hasSuffix(i.name, ".bz2") || i.name.size() < 30 + 4) continue;
+        Path path = dir + "/" + i.name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1)
+            throw SysError(format("getting status of ‘%1%’") % path);
+        if (!S_ISREG(st.st_mode) || st.st_mtime > cutoff) continue;
+        logs[bucket + string(i.name, 0, 30)] = path;
+    }
+
+    if (logs.empty()) return;
+
+    printMsg(lvlInfo, format("archiving %1% logs in bucket ‘%2%’") % logs.size() % bucket);
+
+    createDirs(packDir);
+
+    auto i = logs.begin();
+
+    while (i != logs.end()) {
+
+        /* Append to the most recent pack, unless it's full. */
+        int packNr = -1;
+        for (auto & j : readDirectory(packDir)) {
+            int n;
+            if (hasSuffix(j.name, ".pack")
+                && string2Int(string(j.name, 0, j.name.size() - 5), n)
+                && n > packNr)
+                packNr = n;
+        }
+
+        Path packFile = (format("%1%/%2%.pack") % packDir % packNr).str();
+        struct stat st;
+        if (packNr == -1 || (stat(packFile.c_str(), &st) == 0 && st.st_size >= maxLogPackSize)) {
+            packNr++;
+            packFile = (format("%1%/%2%.pack") % packDir % packNr).str();
+        }
+        Path indexFile = (format("%1%/%2%.idx") % packDir % packNr).str();
+
+        auto index = readLogIndex(indexFile);
+
+        AutoCloseFD fd = open(packFile.c_str(), O_CREAT | O_APPEND | O_WRONLY, 0644);
+        if (fd == -1) throw SysError(format("opening ‘%1%’") % packFile);
+
+        off_t offset = lseek(fd, 0, SEEK_END);
+        if (offset == -1) throw SysError(format("seeking in ‘%1%’") % packFile);
+
+        Paths archived;
+
+        for ( ; i != logs.end() && offset < maxLogPackSize; ++i) {
+            off_t size = appendFile(i->second, fd);
+            index[i->first] = {offset, size};
+            offset += size;
+            archived.push_back(i->second);
+            nrLogsArchived++;
+            bytesLogsArchived += size;
+        }
+
+        /* Make sure the data is on disk before we publish the new
+           index and delete the loose logs. */
+        if (fsync(fd) == -1) throw SysError(format("syncing ‘%1%’") % packFile);
+        fd.close();
+
+        writeLogIndex(indexFile, index);
+
+        for (auto & path : archived)
+            if (unlink(path.c_str()) == -1)
+                throw SysError(format("unlinking ‘%1%’") % path);
+    }
+}
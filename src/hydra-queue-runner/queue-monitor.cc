@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <thread>
+
 #include "state.hh"
 #include "build-result.hh"
 #include "globals.hh"
@@ -36,10 +39,18 @@ void State::queueMonitorLoop()
     unsigned int lastBuildId = 0;
 
     while (true) {
+        if (rescanQueue) {
+            rescanQueue = false;
+            lastBuildId = 0;
+            processQueueChange(*conn);
+        }
+
         bool done = getQueuedBuilds(*conn, store, lastBuildId);
 
         /* Sleep until we get notification from the database about an
-           event. */
+           event. Note that in standby mode, we don't notice the builds
+           finished by the active queue runner, since those don't
+           cause a notification. They're dropped when we take over. */
         if (done) {
             conn->await_notification();
             nrQueueWakeups++;
@@ -68,47 +79,163 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
 {
     printMsg(lvlInfo, format("checking the queue for builds > %1%...") % lastBuildId);
 
-    /* Grab the queued builds from the database, but don't process
-       them yet (since we don't want a long-running transaction). */
-    std::vector<BuildID> newIDs;
-    std::map<BuildID, Build::ptr> newBuildsByID;
-    std::multimap<Path, BuildID> newBuildsByPath;
+    /* Grab the queued builds from the database in batches of
+       ‘queueBatchSize’ rows. This is done by a separate thread with
+       its own connection, so we can already create the steps of the
+       first batch while later batches are being fetched. The number
+       of fetched but unprocessed batches is bounded, so we never hold
+       the entire queue in memory.
+
+       The fetcher first gets the IDs of all queued builds in one
+       short query, and then fetches each batch in its own
+       transaction. So no transaction is kept open for the duration
+       of the load (which would hold back vacuum), or while waiting
+       for us to process a batch. Builds that finish between the two
+       queries are skipped. */
+    typedef std::vector<std::pair<Build::ptr, unsigned int>> Batch; // build and its evaluation
+
+    struct Fetcher
+    {
+        std::queue<Batch> batches;
+        bool done = false, stop = false;
+        std::exception_ptr exception;
+        unsigned int newLastBuildId;
+    };
+
+    Sync<Fetcher> fetcher_;
+    std::condition_variable_any fetcherWakeup;
+
+    fetcher_.lock()->newLastBuildId = lastBuildId;
+
+    std::thread fetcherThread([&]() {
+        ThreadRoles::Registration role(threadRoles, "queue-fetcher");
+        try {
+            auto conn2(dbPool.get());
+
+            std::vector<BuildID> ids;
+            {
+                pqxx::work txn(*conn2);
+                auto res = txn.parameterized
+                    ("select id from Builds where id > $1 and finished = 0 order by globalPriority desc, id")
+                    (lastBuildId).exec();
+                for (auto const & row : res) {
+                    BuildID id = row["id"].as<BuildID>();
+                    if (buildOne && id != buildOne) continue;
+                    ids.push_back(id);
+                }
+            }
 
-    unsigned int newLastBuildId = lastBuildId;
+            for (size_t pos = 0; pos < ids.size(); pos += queueBatchSize) {
+                std::vector<BuildID> batchIds(ids.begin() + pos,
+                    ids.begin() + std::min(pos + queueBatchSize, ids.size()));
 
+                {
+                    auto fetcher(fetcher_.lock());
+                    while (!fetcher->stop && fetcher->batches.size() >= maxQueuedBatches)
+                        fetcher.wait(fetcherWakeup);
+                    if (fetcher->stop) break;
+                }
+
+                std::map<BuildID, std::pair<Build::ptr, unsigned int>> fetched;
+                {
+                    std::string idList;
+                    for (auto id : batchIds)
+                        idList += (idList.empty() ? "" : ",") + std::to_string(id);
+                    pqxx::work txn(*conn2);
+                    auto res = txn.exec(
+                        "select id, project, jobset, job, drvPath, maxsilent, timeout, timestamp, globalPriority, priority, "
+                        "(select min(eval) from JobsetEvalMembers m where m.build = Builds.id) as eval from Builds "
+                        "where id in (" + idList + ") and finished = 0");
+                    for (auto const & row : res) {
+                        auto build = std::make_shared<Build>();
+                        build->id = row["id"].as<BuildID>();
+                        build->drvPath = row["drvPath"].as<string>();
+                        build->projectName = row["project"].as<string>();
+                        build->jobsetName = row["jobset"].as<string>();
+                        build->jobName = row["job"].as<string>();
+                        build->maxSilentTime = row["maxsilent"].as<int>();
+                        build->buildTimeout = row["timeout"].as<int>();
+                        build->timestamp = row["timestamp"].as<time_t>();
+                        build->globalPriority = row["globalPriority"].as<int>();
+                        build->localPriority = row["priority"].as<int>();
+                        fetched[build->id] = {build, row["eval"].is_null() ? 0 : row["eval"].as<unsigned int>()};
+                    }
+                }
+
+                /* Keep the order of the first query. */
+                Batch batch;
+                for (auto id : batchIds) {
+                    auto i = fetched.find(id);
+                    if (i != fetched.end()) batch.push_back(i->second);
+                }
+
+                auto fetcher(fetcher_.lock());
+                if (fetcher->stop) break;
+                BuildID newLastBuildId = *std::max_element(batchIds.begin(), batchIds.end());
+                if (newLastBuildId > fetcher->newLastBuildId)
+                    fetcher->newLastBuildId = newLastBuildId;
+                fetcher->batches.push(batch);
+                fetcherWakeup.notify_all();
+            }
+        } catch (...) {
+            fetcher_.lock()->exception = std::current_exception();
+        }
+
+        fetcher_.lock()->done = true;
+        fetcherWakeup.notify_all();
+    });
+
+    /* Make sure the fetcher thread is gone before we return or
+       unwind. */
+    struct StopFetcher
     {
-        pqxx::work txn(conn);
+        Sync<Fetcher> & fetcher_;
+        std::condition_variable_any & fetcherWakeup;
+        std::thread & thread;
+        ~StopFetcher()
+        {
+            fetcher_.lock()->stop = true;
+            fetcherWakeup.notify_all();
+            thread.join();
+        }
+    };
+    StopFetcher stopFetcher{fetcher_, fetcherWakeup, fetcherThread};
+
+    /* Get the next batch of queued builds, or false if there are no
+       more. */
+    auto nextBatch = [&](Batch & batch) -> bool {
+        auto fetcher(fetcher_.lock());
+        while (fetcher->batches.empty() && !fetcher->done)
+            fetcher.wait(fetcherWakeup);
+        if (fetcher->exception) std::rethrow_exception(fetcher->exception);
+        if (fetcher->batches.empty()) return false;
+        batch = fetcher->batches.front();
+        fetcher->batches.pop();
+        fetcherWakeup.notify_all();
+        return true;
+    };
 
-        auto res = txn.parameterized
-            ("select id, project, jobset, job, drvPath, maxsilent, timeout, timestamp, globalPriority, priority from Builds "
-             "where id > $1 and finished = 0 order by globalPriority desc, id")
-            (lastBuildId).exec();
+    std::map<BuildID, Build::ptr> newBuildsByID;
+    std::multimap<Path, BuildID> newBuildsByPath;
 
-        for (auto const & row : res) {
-            auto builds_(builds.lock());
-            BuildID id = row["id"].as<BuildID>();
-            if (buildOne && id != buildOne) continue;
-            if (id > newLastBuildId) newLastBuildId = id;
-            if (builds_->count(id)) continue;
-
-            auto build = std::make_shared<Build>();
-            build->id = id;
-            build->drvPath = row["drvPath"].as<string>();
-            build->projectName = row["project"].as<string>();
-            build->jobsetName = row["jobset"].as<string>();
-            build->jobName = row["job"].as<string>();
-            build->maxSilentTime = row["maxsilent"].as<int>();
-            build->buildTimeout = row["timeout"].as<int>();
-            build->timestamp = row["timestamp"].as<time_t>();
-            build->globalPriority = row["globalPriority"].as<int>();
-            build->localPriority = row["priority"].as<int>();
-            build->jobset = createJobset(txn, build->projectName, build->jobsetName);
-
-            newIDs.push_back(id);
-            newBuildsByID[id] = build;
-            newBuildsByPath.emplace(std::make_pair(build->drvPath, id));
+    /* The step graphs of the evaluations of the new builds, if the
+       evaluator produced them. */
+    StepGraph stepGraph;
+    std::set<unsigned int> evalsSeen;
+
+    auto loadStepGraph = [&](unsigned int evalId) {
+        if (!evalId || !evalsSeen.insert(evalId).second) return;
+        Path fileName = stepGraphDir + "/" + std::to_string(evalId);
+        if (!pathExists(fileName)) return;
+        try {
+            auto graph = readStepGraph(fileName);
+            printMsg(lvlChatty, format("loaded step graph of evaluation %1% (%2% derivations)")
+                % evalId % graph.size());
+            stepGraph.insert(graph.begin(), graph.end());
+        } catch (Error & e) {
+            printMsg(lvlError, format("ignoring step graph ‘%1%’: %2%") % fileName % e.msg());
         }
-    }
+    };
 
     std::set<Step::ptr> newRunnable;
     unsigned int nrAdded;
@@ -121,6 +248,7 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
 
         if (!store->isValidPath(build->drvPath)) {
             /* Derivation has been GC'ed prematurely. */
+            if (standby) return;
             printMsg(lvlError, format("aborting GC'ed build %1%") % build->id);
             if (!build->finishedInDB) {
                 pqxx::work txn(conn);
@@ -139,12 +267,16 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
 
         std::set<Step::ptr> newSteps;
         std::set<Path> finishedDrvs; // FIXME: re-use?
-        Step::ptr step = createStep(store, conn, build, build->drvPath, build, 0, finishedDrvs, newSteps, newRunnable);
+        Step::ptr step = createStep(store, conn, build, build->drvPath, build, 0, finishedDrvs, newSteps, newRunnable, stepGraph);
 
         /* Some of the new steps may be the top level of builds that
-           we haven't processed yet. So do them now. This ensures that
-           if build A depends on build B with top-level step X, then X
-           will be "accounted" to B in doBuildStep(). */
+           we haven't processed yet. So do them now. If build A
+           depends on build B with top-level step X, this ensures that
+           X will be "accounted" to B in doBuildStep(), provided that
+           B has been fetched already (i.e. is in the same batch as A
+           or an earlier one). If B is in a later batch, X is
+           accounted to B only if B is loaded before X starts;
+           otherwise it's accounted to A. */
         for (auto & r : newSteps) {
             auto i = newBuildsByPath.find(r->drvPath);
             if (i == newBuildsByPath.end()) continue;
@@ -156,8 +288,9 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
         /* If we didn't get a step, it means the step's outputs are
            all valid. So we mark this as a finished, cached build. */
         if (!step) {
-            Derivation drv = readDerivation(build->drvPath);
-            BuildOutput res = getBuildOutput(store, drv);
+            if (standby) return;
+
+            BuildOutput res = getBuildOutputCached(store, build->drvPath);
 
             pqxx::work txn(conn);
             time_t now = time(0);
@@ -166,6 +299,8 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
 
             build->finishedInDB = true;
 
+            if (buildOne == build->id) exit(0); // testing hack
+
             return;
         }
 
@@ -173,32 +308,37 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
            the build right away. */
         bool badStep = false;
         for (auto & r : newSteps)
-            if (checkCachedFailure(r, conn)) {
+            if (checkCachedFailure(r, *getReadOnlyConnection())) {
+                if (standby) return;
                 printMsg(lvlError, format("marking build %1% as cached failure") % build->id);
                 if (!build->finishedInDB) {
-                    pqxx::work txn(conn);
 
                     /* Find the previous build step record, first by
                        derivation path, then by output path. */
                     BuildID propagatedFrom = 0;
-
-                    auto res = txn.parameterized
-                        ("select max(build) from BuildSteps where drvPath = $1 and startTime != 0 and stopTime != 0 and status = 1")
-                        (r->drvPath).exec();
-                    if (!res[0][0].is_null()) propagatedFrom = res[0][0].as<BuildID>();
-
-                    if (!propagatedFrom) {
-                        for (auto & output : r->drv.outputs) {
-                            auto res = txn.parameterized
-                                ("select max(s.build) from BuildSteps s join BuildStepOutputs o on s.build = o.build where path = $1 and startTime != 0 and stopTime != 0 and status = 1")
-                                (output.second.path).exec();
-                            if (!res[0][0].is_null()) {
-                                propagatedFrom = res[0][0].as<BuildID>();
-                                break;
+                    {
+                        auto conn2(getReadOnlyConnection());
+                        pqxx::work txn(*conn2);
+
+                        auto res = txn.parameterized
+                            ("select max(build) from BuildSteps where drvPath = $1 and startTime != 0 and stopTime != 0 and status = 1")
+                            (r->drvPath).exec();
+                        if (!res[0][0].is_null()) propagatedFrom = res[0][0].as<BuildID>();
+
+                        if (!propagatedFrom) {
+                            for (auto & output : r->drv.outputs) {
+                                auto res = txn.parameterized
+                                    ("select max(s.build) from BuildSteps s join BuildStepOutputs o on s.build = o.build where path = $1 and startTime != 0 and stopTime != 0 and status = 1")
+                                    (output.second.path).exec();
+                                if (!res[0][0].is_null()) {
+                                    propagatedFrom = res[0][0].as<BuildID>();
+                                    break;
+                                }
                             }
                         }
                     }
 
+                    pqxx::work txn(conn);
                     createBuildStep(txn, 0, build, r, "", bssCachedFailure, "", propagatedFrom);
                     txn.parameterized
                         ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $3, isCachedBuild = 1 where id = $1 and finished = 0")
@@ -208,6 +348,7 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
                     txn.commit();
                     build->finishedInDB = true;
                     nrBuildsDone++;
+                    if (buildOne == build->id) exit(0); // testing hack
                 }
                 badStep = true;
                 break;
@@ -236,33 +377,80 @@ bool State::getQueuedBuilds(Connection & conn, std::shared_ptr<StoreAPI> store,
        even while we're still processing other new builds. */
     system_time start = std::chrono::system_clock::now();
 
-    for (auto id : newIDs) {
-        auto i = newBuildsByID.find(id);
-        if (i == newBuildsByID.end()) continue;
-        auto build = i->second;
+    bool timedOut = false;
+    Batch batch;
 
-        newRunnable.clear();
-        nrAdded = 0;
-        try {
-            createBuild(build);
-        } catch (Error & e) {
-            e.addPrefix(format("while loading build %1%: ") % build->id);
-            throw;
+    while (!timedOut && nextBatch(batch)) {
+
+        /* Skip builds that we already have. */
+        std::vector<BuildID> newIDs;
+        {
+            auto builds_(builds.lock());
+            for (auto & i : batch) {
+                auto & build(i.first);
+                if (builds_->count(build->id)) continue;
+                newIDs.push_back(build->id);
+                newBuildsByID[build->id] = build;
+                newBuildsByPath.emplace(std::make_pair(build->drvPath, build->id));
+            }
+        }
+
+        for (auto & i : batch)
+            if (newBuildsByID.count(i.first->id)) loadStepGraph(i.second);
+
+        /* Look up the jobsets of the new builds. This may hit the
+           database, so we don't do it while holding the ‘builds’
+           lock. It must use the primary, since the jobsets may have
+           been created after the replica's last replayed
+           transaction. */
+        {
+            pqxx::work txn(conn);
+            for (auto id : newIDs) {
+                auto & build(newBuildsByID[id]);
+                build->jobset = createJobset(txn, build->projectName, build->jobsetName);
+            }
         }
 
-        /* Add the new runnable build steps to ‘runnable’ and wake up
-           the builder threads. */
-        printMsg(lvlChatty, format("got %1% new runnable steps from %2% new builds") % newRunnable.size() % nrAdded);
-        for (auto & r : newRunnable)
-            makeRunnable(r);
+        for (auto id : newIDs) {
+            auto i = newBuildsByID.find(id);
+            if (i == newBuildsByID.end()) continue;
+            auto build = i->second;
+
+            {
+                std::lock_guard<std::mutex> lock(queueLoadMutex);
+
+                newRunnable.clear();
+                nrAdded = 0;
+                try {
+                    createBuild(build);
+                } catch (Error & e) {
+                    e.addPrefix(format("while loading build %1%: ") % build->id);
+                    throw;
+                }
+
+                /* Add the new runnable build steps to ‘runnable’ and wake up
+                   the builder threads. */
+                printMsg(lvlChatty, format("got %1% new runnable steps from %2% new builds") % newRunnable.size() % nrAdded);
+                for (auto & r : newRunnable)
+                    makeRunnable(r);
+            }
 
-        nrBuildsRead += nrAdded;
+            nrBuildsRead += nrAdded;
 
-        /* Stop after a certain time to allow priority bumps to be
-           processed. */
-        if (std::chrono::system_clock::now() > start + std::chrono::seconds(600)) break;
+            /* Stop after a certain time to allow priority bumps to be
+               processed. */
+            if (std::chrono::system_clock::now() > start + std::chrono::seconds(600)) {
+                timedOut = true;
+                break;
+            }
+        }
     }
 
+    /* If we stopped early, there may be builds that we haven't
+       fetched yet, so check everything again next time. */
+    if (timedOut) return false;
+
+    unsigned int newLastBuildId = fetcher_.lock()->newLastBuildId;
     lastBuildId = newBuildsByID.empty() ? newLastBuildId : newBuildsByID.begin()->first - 1;
     return newBuildsByID.empty();
 }
@@ -286,7 +474,9 @@ void Build::propagatePriorities()
 
 void State::processQueueChange(Connection & conn)
 {
-    /* Get the current set of queued builds. */
+    /* Get the current set of queued builds. This must come from the
+       primary: on a replica, builds that we just loaded may not be
+       visible yet, and would then appear to have been cancelled. */
     std::map<BuildID, int> currentIds;
     {
         pqxx::work txn(conn);
@@ -315,10 +505,87 @@ void State::processQueueChange(Connection & conn)
 }
 
 
+void State::revalidateSteps()
+{
+    auto store = openStore();
+
+    /* Don't run concurrently with the queue monitor creating steps. */
+    std::lock_guard<std::mutex> lock(queueLoadMutex);
+
+    /* Steps that haven't been fully created yet are left alone;
+       createStep() will check their outputs itself. */
+    std::vector<Step::ptr> steps2;
+    {
+        auto steps_(steps.lock());
+        for (auto & i : *steps_) {
+            auto step = i.second.lock();
+            if (step && step->state.lock()->created) steps2.push_back(step);
+        }
+    }
+
+    std::set<Step::ptr> done;
+    for (auto & step : steps2) {
+        bool valid = true;
+        for (auto & i : step->drv.outputs)
+            if (!store->isValidPath(i.second.path)) { valid = false; break; }
+        if (valid) done.insert(step);
+    }
+
+    printMsg(lvlInfo, format("%1% of %2% steps have been built by the previous queue runner")
+        % done.size() % steps2.size());
+
+    if (done.empty()) return;
+
+    {
+        auto steps_(steps.lock());
+        for (auto & step : done)
+            steps_->erase(step->drvPath);
+    }
+
+    /* Builds whose top-level step is done were not finished in the
+       database by the previous queue runner. Forget about them, so
+       that the rescan reloads them and marks them as finished. */
+    {
+        auto builds_(builds.lock());
+        for (auto i = builds_->begin(); i != builds_->end(); )
+            if (done.count(i->second->toplevel)) i = builds_->erase(i); else ++i;
+    }
+
+    {
+        auto runnable_(runnable.lock());
+        for (auto i = runnable_->begin(); i != runnable_->end(); )
+            if (done.count(i->lock())) i = runnable_->erase(i); else ++i;
+    }
+
+    for (auto & step : done) {
+        std::vector<Step::wptr> rdeps;
+        {
+            auto step_(step->state.lock());
+            rdeps = step_->rdeps;
+        }
+
+        for (auto & rdepWeak : rdeps) {
+            auto rdep = rdepWeak.lock();
+            if (!rdep || done.count(rdep)) continue;
+
+            bool runnable = false;
+            {
+                auto rdep_(rdep->state.lock());
+                if (rdep_->deps.erase(step) && rdep_->deps.empty() && rdep_->created)
+                    runnable = true;
+            }
+
+            if (runnable) makeRunnable(rdep);
+        }
+    }
+}
+
+
 Step::ptr State::createStep(std::shared_ptr<StoreAPI> store,
     Connection & conn, Build::ptr build, const Path & drvPath,
     Build::ptr referringBuild, Step::ptr referringStep, std::set<Path> & finishedDrvs,
-    std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable)
+    std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable,
+    const StepGraph & stepGraph)
 {
     if (finishedDrvs.find(drvPath) != finishedDrvs.end()) return 0;
 
@@ -370,11 +637,20 @@ Step::ptr State::createStep(std::shared_ptr<StoreAPI> store,
     /* Initialize the step. Note that the step may be visible in
        ‘steps’ before this point, but that doesn't matter because
        it's not runnable yet, and other threads won't make it
-       runnable while step->created == false. */
-    step->drv = readDerivation(drvPath);
+       runnable while step->created == false. Prefer the step graph
+       produced by the evaluator over parsing the .drv file. */
+    auto g = stepGraph.find(drvPath);
+    if (g != stepGraph.end()) {
+        step->drv = g->second;
+        step->drvFromStepGraph = true;
+        nrStepsFromStepGraph++;
+    } else
+        step->drv = readDerivation(drvPath);
 
     step->preferLocalBuild = willBuildLocally(step->drv);
 
+    step->isFixedOutput = step->drv.outputs.size() == 1 && step->drv.outputs.begin()->second.hash != "";
+
     step->systemType = step->drv.platform;
     {
         auto i = step->drv.env.find("requiredSystemFeatures");
@@ -389,6 +665,14 @@ Step::ptr State::createStep(std::shared_ptr<StoreAPI> store,
         }
     }
 
+    /* Estimate the resources used by the step. Steps that require
+       ‘big-parallel’ are expected to use all cores of the machine. */
+    if (step->requiredSystemFeatures.count("big-parallel")) {
+        step->cores = 0;
+        step->memory = bigParallelMemory;
+    } else
+        step->memory = defaultStepMemory;
+
     /* Are all outputs valid? */
     bool valid = true;
     PathSet outputs = outputPaths(step->drv);
@@ -403,9 +687,10 @@ Step::ptr State::createStep(std::shared_ptr<StoreAPI> store,
 
     /* Try to substitute the missing paths. Note: can't use the more
        efficient querySubstitutablePaths() here because upstream Hydra
-       servers don't allow it (they have "WantMassQuery: 0"). */
+       servers don't allow it (they have "WantMassQuery: 0"). In
+       standby mode, this is left to the active queue runner. */
     assert(missing.size() == missingPaths.size());
-    if (!missing.empty() && settings.useSubstitutes) {
+    if (!missing.empty() && settings.useSubstitutes && !standby) {
         SubstitutablePathInfos infos;
         store->querySubstitutablePathInfos(missingPaths, infos);
         if (infos.size() == missingPaths.size()) {
@@ -444,7 +729,7 @@ Step::ptr State::createStep(std::shared_ptr<StoreAPI> store,
 
     /* Create steps for the dependencies. */
     for (auto & i : step->drv.inputDrvs) {
-        auto dep = createStep(store, conn, build, i.first, 0, step, finishedDrvs, newSteps, newRunnable);
+        auto dep = createStep(store, conn, build, i.first, 0, step, finishedDrvs, newSteps, newRunnable, stepGraph);
         if (dep) {
             auto step_(step->state.lock());
             step_->deps.insert(dep);
@@ -486,6 +771,29 @@ Jobset::ptr State::createJobset(pqxx::work & txn,
     auto jobset = std::make_shared<Jobset>();
     jobset->setShares(shares);
 
+    /* Apply the concurrency limits from hydra.conf, given as
+       ‘max_concurrent_steps.<project>:<jobset>’,
+       ‘min_concurrent_steps.<project>:<jobset>’ and
+       ‘max_concurrent_steps.<project>’. */
+    auto getLimit = [&](const std::string & key) {
+        unsigned int n = 0;
+        auto i = hydraConfig.find(key);
+        if (i != hydraConfig.end()) string2Int(i->second, n);
+        return n;
+    };
+    jobset->limit->maxSteps = getLimit("max_concurrent_steps." + projectName + ":" + jobsetName);
+    jobset->limit->minSteps = getLimit("min_concurrent_steps." + projectName + ":" + jobsetName);
+    auto projectMaxSteps = getLimit("max_concurrent_steps." + projectName);
+    if (projectMaxSteps) {
+        auto projectLimits_(projectLimits.lock());
+        auto & limit((*projectLimits_)[projectName]);
+        if (!limit) {
+            limit = std::make_shared<StepLimit>();
+            limit->maxSteps = projectMaxSteps;
+        }
+        jobset->projectLimit = limit;
+    }
+
     /* Load the build steps from the last 24 hours. */
     res = txn.parameterized
         ("select s.startTime, s.stopTime from BuildSteps s join Builds b on build = id "
@@ -497,6 +805,12 @@ Jobset::ptr State::createJobset(pqxx::work & txn,
         jobset->addStep(startTime, stopTime - startTime);
     }
 
+    /* Start the jobset's virtual tag at the current virtual time,
+       plus the build time it used recently, so that restarting the
+       queue runner doesn't reset the fair share of the jobsets. */
+    jobset->pruneSteps();
+    jobset->setVirtualTag(virtualTime + jobset->shareUsed());
+
     auto jobsets_(jobsets.lock());
     // Can't happen because only this thread adds to "jobsets".
     assert(jobsets_->find(p) == jobsets_->end());
@@ -1,17 +1,24 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
 #include <queue>
+#include <thread>
 
+#include "build-result.hh"
 #include "db.hh"
 #include "counter.hh"
 #include "pathlocks.hh"
 #include "pool.hh"
+#include "step-graph.hh"
 #include "sync.hh"
+#include "thread-roles.hh"
 
 #include "store-api.hh"
 #include "derivations.hh"
@@ -58,11 +65,42 @@ struct RemoteResult : nix::BuildResult
 };
 
 
+/* A source that copies everything read from it to a file
+   descriptor. */
+struct FdTeeSource : nix::Source
+{
+    nix::Source & orig;
+    int fd;
+    FdTeeSource(nix::Source & orig, int fd) : orig(orig), fd(fd) { }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = orig.read(data, len);
+        nix::writeFull(fd, data, n);
+        return n;
+    }
+};
+
+
 struct Step;
-struct BuildOutput;
+struct RemoteSession;
+
 
+/* A limit on the number of concurrently running build steps of a
+   jobset or project, configured in hydra.conf. */
+struct StepLimit
+{
+    typedef std::shared_ptr<StepLimit> ptr;
+
+    unsigned int maxSteps = 0; // 0 = unlimited
+    unsigned int minSteps = 0; // steps that get priority
+    counter nrRunning{0};
+
+    bool hasRoom() { return !maxSteps || nrRunning < maxSteps; }
+    bool belowMinimum() { return nrRunning < minSteps; }
+};
 
-class Jobset
+
+class Jobset : public InstanceCounter<Jobset>
 {
 public:
 
@@ -79,6 +117,22 @@ private:
     /* The start time and duration of the most recent build steps. */
     Sync<std::map<time_t, time_t>> steps;
 
+    /* Weighted fair queuing state. The virtual tag of a jobset is the
+       build time charged to it divided by its number of shares. Time
+       is charged while steps run, at a rate of ‘runningWeight’, the
+       number of slots used by the jobset's steps (a slot shared by
+       several jobsets counts fractionally for each). */
+    struct FairShare
+    {
+        double virtualTag = 0;
+        double runningWeight = 0;
+        system_time lastCharged;
+        bool backlogged = false;
+    };
+    Sync<FairShare> fairShare;
+
+    void charge(FairShare & fairShare_, system_time now);
+
 public:
 
     double shareUsed()
@@ -89,18 +143,46 @@ public:
     void setShares(int shares_)
     {
         assert(shares_ > 0);
+        auto fairShare_(fairShare.lock());
+        charge(*fairShare_, std::chrono::system_clock::now());
         shares = shares_;
     }
 
     time_t getSeconds() { return seconds; }
 
+    size_t nrRecentSteps() { return steps.lock()->size(); }
+
+    /* The concurrency limits of this jobset and of its project (if
+       any). */
+    StepLimit::ptr limit{std::make_shared<StepLimit>()};
+    StepLimit::ptr projectLimit;
+
+    /* The number of runnable steps of this jobset, as of the last
+       dispatcher pass. */
+    std::atomic<unsigned int> nrRunnableSteps{0};
+
     void addStep(time_t startTime, time_t duration);
 
     void pruneSteps();
+
+    /* Return the jobset's virtual tag, including the time accrued
+       by its running steps. If the jobset becomes backlogged (has
+       runnable or running steps) after having been idle, its tag is
+       first advanced to ‘virtualTime’ so that it cannot claim credit
+       for the time it was idle. */
+    double updateVirtualTag(bool hasRunnable, double virtualTime);
+
+    double getVirtualTag();
+
+    void setVirtualTag(double tag);
+
+    /* Start or stop charging the jobset for a running step. */
+    void startRunning(double weight);
+    void stopRunning(double weight);
 };
 
 
-struct Build
+struct Build : InstanceCounter<Build>
 {
     typedef std::shared_ptr<Build> ptr;
     typedef std::weak_ptr<Build> wptr;
@@ -128,17 +210,34 @@ struct Build
 };
 
 
-struct Step
+struct Step : InstanceCounter<Step>
 {
     typedef std::shared_ptr<Step> ptr;
     typedef std::weak_ptr<Step> wptr;
 
     nix::Path drvPath;
     nix::Derivation drv;
+
+    /* Whether ‘drv’ was taken from a step graph, in which case it
+       lacks the builder, arguments and most of the environment. Use
+       getFullDerivation() when those are needed. */
+    bool drvFromStepGraph = false;
+
     std::set<std::string> requiredSystemFeatures;
     bool preferLocalBuild;
+
+    /* Whether this is a fixed-output derivation, i.e. its output
+       path depends only on the expected hash of its output. */
+    bool isFixedOutput = false;
     std::string systemType; // concatenation of drv.platform and requiredSystemFeatures
 
+    /* The resources that the step is expected to use while
+       building: the number of CPU cores (where 0 means all cores of
+       the machine) and the amount of memory in MiB. These are only
+       enforced on machines that have resource budgets. */
+    unsigned int cores = 1;
+    unsigned int memory = 0;
+
     struct State
     {
         /* Whether the step has finished initialisation. */
@@ -167,10 +266,6 @@ struct Step
            step. */
         int highestGlobalPriority{0};
 
-        /* The lowest share used of any jobset depending on this
-           step. */
-        double lowestShareUsed;
-
         /* The highest local priority of any build depending on this
            step. */
         int highestLocalPriority{0};
@@ -180,6 +275,10 @@ struct Step
 
         /* The time at which this step became runnable. */
         system_time runnableSince;
+
+        /* The aging level of the step as of the last dispatcher
+           pass. */
+        unsigned int agingLevel = 0;
     };
 
     std::atomic_bool finished{false}; // debugging
@@ -190,6 +289,11 @@ struct Step
     {
         //printMsg(lvlError, format("destroying step %1%") % drvPath);
     }
+
+    nix::Derivation getFullDerivation()
+    {
+        return drvFromStepGraph ? nix::readDerivation(drvPath) : drv;
+    }
 };
 
 
@@ -199,7 +303,7 @@ void getDependents(Step::ptr step, std::set<Build::ptr> & builds, std::set<Step:
 void visitDependencies(std::function<void(Step::ptr)> visitor, Step::ptr step);
 
 
-struct Machine
+struct Machine : InstanceCounter<Machine>
 {
     typedef std::shared_ptr<Machine> ptr;
 
@@ -211,12 +315,36 @@ struct Machine
     float speedFactor = 1.0;
     std::string sshPublicHostKey;
 
+    /* Whether to let the machine substitute missing inputs from its
+       binary caches before we upload them. */
+    bool useSubstitutes = false;
+
+    /* The number of CPU cores and the amount of memory (in MiB) of
+       the machine. If set, steps are only started on the machine if
+       their expected resource use fits within what is left. Zero
+       means there is no budget. */
+    unsigned int cores = 0, memory = 0;
+
+    /* The number of job slots reserved for steps that require a
+       particular feature (‘reserve:<feature>=<n>’). Other steps only
+       get such a slot if no step requiring the feature is runnable,
+       and only if they are expected to finish soon. */
+    std::map<std::string, unsigned int> reservedSlots;
+
     struct State {
         typedef std::shared_ptr<State> ptr;
         counter currentJobs{0};
         counter nrStepsDone{0};
         counter totalStepTime{0}; // total time for steps, including closure copying
         counter totalStepBuildTime{0}; // total build time for steps
+        counter nrPathsSubstituted{0}; // inputs substituted by the machine
+        counter bytesSubstituted{0}; // upload bytes avoided by substitution
+        counter totalSubstitutionTimeMs{0}; // time spent waiting for substitution
+        counter currentCores{0}; // cores reserved by running steps
+        counter currentMemory{0}; // memory (MiB) reserved by running steps
+        counter totalCoreTime{0}; // core-seconds reserved by finished steps
+        counter nrSlotsLent{0}; // reserved slots given to other steps
+        Sync<std::map<std::string, unsigned int>> reservedSlotsInUse;
         std::atomic<time_t> idleSince{0};
 
         struct ConnectInfo
@@ -229,6 +357,10 @@ struct Machine
         /* Mutex to prevent multiple threads from sending data to the
            same machine (which would be inefficient). */
         std::mutex sendLock;
+
+        /* Number of sessions waiting for ‘sendLock’. The prefetcher
+           gives way to them. */
+        counter nrSendersWaiting{0};
     };
 
     State::ptr state;
@@ -244,6 +376,69 @@ struct Machine
             if (supportedFeatures.find(f) == supportedFeatures.end()) return false;
         return true;
     }
+
+    /* The part of the machine's budgets that a step would reserve.
+       A step that needs more than the machine has gets all of it, so
+       that it can still run once the machine is otherwise idle. */
+    unsigned int coresFor(Step::ptr step)
+    {
+        return step->cores == 0 ? cores : std::min(step->cores, cores);
+    }
+
+    unsigned int memoryFor(Step::ptr step)
+    {
+        return std::min(step->memory, memory);
+    }
+
+    /* Whether the step fits in what is left of the machine's
+       budgets. */
+    bool hasCapacityFor(Step::ptr step)
+    {
+        return (!cores || state->currentCores + coresFor(step) <= cores)
+            && (!memory || state->currentMemory + memoryFor(step) <= memory);
+    }
+
+    /* Choose a free job slot for ‘step’, given that the machine has
+       fewer than ‘maxJobs’ running steps. Set ‘feature’ to the
+       feature whose reserved slot the step gets, or to "" for an
+       unreserved slot. ‘mayLend(f)’ determines whether the step can
+       borrow a slot reserved for feature ‘f’. Return false if none of
+       the free slots may be used by the step. */
+    bool chooseSlot(Step::ptr step, std::function<bool(const std::string &)> mayLend,
+        std::string & feature, bool & lent)
+    {
+        feature = "";
+        lent = false;
+        if (reservedSlots.empty()) return true;
+
+        auto inUse(state->reservedSlotsInUse.lock());
+
+        long reserved = 0, reservedUsed = 0;
+        for (auto & i : reservedSlots) {
+            reserved += i.second;
+            reservedUsed += (*inUse)[i.first];
+        }
+
+        for (auto & f : step->requiredSystemFeatures) {
+            auto i = reservedSlots.find(f);
+            if (i != reservedSlots.end() && (*inUse)[f] < i->second) {
+                feature = f;
+                return true;
+            }
+        }
+
+        if ((long) state->currentJobs - reservedUsed < (long) maxJobs - reserved)
+            return true;
+
+        for (auto & i : reservedSlots)
+            if ((*inUse)[i.first] < i.second && mayLend(i.first)) {
+                feature = i.first;
+                lent = true;
+                return true;
+            }
+
+        return false;
+    }
 };
 
 
@@ -256,9 +451,66 @@ private:
     const unsigned int retryInterval = 60; // seconds
     const float retryBackoff = 3.0;
     const unsigned int maxParallelCopyClosure = 4;
+    const unsigned int queueBatchSize = 1000; // builds per queue fetch
+    const unsigned int maxQueuedBatches = 4; // fetched but unprocessed batches
+    const unsigned int defaultStepMemory = 1024; // MiB
+    const unsigned int bigParallelMemory = 4096; // MiB
+    const unsigned int maxPackingDelay = 15 * 60; // seconds
+    const unsigned int prefetchDepth = 2; // predicted steps per machine
+    const unsigned int maxCachedBuildOutputs = 1000;
+    const unsigned int standbyPollInterval = 5; // seconds
+    const unsigned int advisoryLockCheckInterval = 10; // seconds
+    const long long advisoryLockKey = 0x4879647261; // "Hydra"
+    const unsigned int replicaLagCheckInterval = 5; // seconds
+    const unsigned int logArchiveInterval = 6 * 60 * 60; // seconds
+    const off_t maxLogPackSize = 1024 * 1024 * 1024;
 
     nix::Path hydraData, logDir;
 
+    /* Settings from hydra.conf. */
+    std::map<std::string, std::string> hydraConfig;
+
+    /* Optional local binary cache to which the outputs of remote
+       builds are written while they are being downloaded. */
+    nix::Path binaryCacheDir;
+
+    /* Compressed logs older than this many days are moved into
+       packed archives (0 = never). */
+    unsigned int logArchiveAge = 0;
+
+    /* How long the dispatcher waits after being woken up before
+       doing a pass, to handle a burst of wakeups in one pass. */
+    unsigned int dispatcherBatchWindow = 50; // milliseconds
+
+    /* The maximum expected duration of a step that may borrow a job
+       slot reserved for a feature it doesn't need. */
+    unsigned int reservedSlotLendTime = 10 * 60; // seconds
+
+    /* The maximum number of small steps to build one after another
+       over a single connection to a build machine, and the predicted
+       duration (in seconds) below which a step counts as small. */
+    unsigned int maxBatchSize = 1;
+    unsigned int batchStepMaxDuration = 10;
+
+    /* Priority aging. A step's aging level is the time it has been
+       runnable divided by ‘stepAgingInterval’ (or, with logarithmic
+       aging, the base-2 logarithm of that plus one, so long waits
+       are grouped in ever coarser levels). Steps with a higher
+       aging level are dispatched first regardless of the fair share
+       of their jobsets, so that no step waits indefinitely. Only
+       builds bumped by an admin take precedence. 0 disables
+       aging. */
+    unsigned int stepAgingInterval = 0; // seconds
+    bool stepAgingLogarithmic = false;
+
+    /* Moving average of the build time of steps, by derivation name
+       without version. Used to predict the duration of steps. */
+    Sync<std::map<std::string, float>> stepDurations;
+
+    /* Directory containing the step graphs written by the evaluator,
+       named after the evaluation ID. */
+    nix::Path stepGraphDir;
+
     /* The queued builds. */
     typedef std::map<BuildID, Build::ptr> Builds;
     Sync<Builds> builds;
@@ -267,6 +519,9 @@ private:
     typedef std::map<std::pair<std::string, std::string>, Jobset::ptr> Jobsets;
     Sync<Jobsets> jobsets;
 
+    /* Concurrency limits of projects, by name. */
+    Sync<std::map<std::string, StepLimit::ptr>> projectLimits;
+
     /* All active or pending build steps (i.e. dependencies of the
        queued builds). Note that these are weak pointers. Steps are
        kept alive by being reachable from Builds or by being in
@@ -285,6 +540,33 @@ private:
     /* PostgreSQL connection pool. */
     Pool<Connection> dbPool;
 
+    /* Connection pool for a read-only replica of the database, if
+       $HYDRA_DBI_RO is set. Read-only queries that can tolerate
+       slightly stale data go there, unless the replica lags more than
+       ‘maxReplicaLag’ seconds behind the primary. */
+    Pool<ReplicaConnection> dbReplicaPool;
+    bool haveReplica = false;
+    unsigned int maxReplicaLag = 10; // seconds
+
+    struct ReplicaStatus
+    {
+        bool up = true;
+        double lag = 0; // seconds
+        time_t lastCheck = 0;
+    };
+    Sync<ReplicaStatus> replicaStatus;
+
+    /* A connection to either the replica or the primary. */
+    class ReadOnlyConnection
+    {
+        std::unique_ptr<Pool<Connection>::Handle> primary;
+        std::unique_ptr<Pool<ReplicaConnection>::Handle> replica;
+        friend class State;
+    public:
+        Connection & operator * () { return replica ? (Connection &) **replica : **primary; }
+        Connection * operator -> () { return &**this; }
+    };
+
     /* The build machines. */
     typedef std::map<std::string, Machine::ptr> Machines;
     Sync<Machines> machines; // FIXME: use atomic_shared_ptr
@@ -292,6 +574,7 @@ private:
     /* Various stats. */
     time_t startedAt;
     counter nrBuildsRead{0};
+    counter nrStepsFromStepGraph{0};
     counter nrBuildsDone{0};
     counter nrStepsDone{0};
     counter nrActiveSteps{0};
@@ -305,13 +588,87 @@ private:
     counter totalStepBuildTime{0}; // total build time for steps
     counter nrQueueWakeups{0};
     counter nrDispatcherWakeups{0};
+    counter nrStepsDispatched{0};
+    counter totalDispatchLatencyMs{0}; // from runnable to dispatched
+    counter maxDispatchLatencyMs{0};
+    counter nrAgedStepsDispatched{0}; // with a non-zero aging level
+    counter dispatchTimeMs{0}; // time spent in doDispatch()
     counter bytesSent{0};
     counter bytesReceived{0};
+    counter nrReplicaQueries{0};
+    counter nrReplicaFallbacks{0};
+
+    counter nrBatches{0};
+    counter nrBatchedSteps{0};
+    counter nrPrefetches{0};
+    counter nrPrefetchesFailed{0};
+    counter nrPrefetchesAborted{0};
+    counter nrPrefetchHits{0};
+    counter nrPrefetchMisses{0};
+    counter bytesPrefetched{0};
+    counter bytesPrefetchWasted{0};
+
+    /* Steps whose input closures are being pushed ahead of time to
+       the machine on which the dispatcher expects them to run. */
+    struct Prefetch
+    {
+        enum { queued, sending, done } status = queued;
+        Step::wptr step;
+        Machine::ptr machine;
+        unsigned long bytes = 0;
+    };
+    Sync<std::map<nix::Path, Prefetch>> prefetches;
+    std::condition_variable_any prefetcherWakeup;
+
+    /* Fixed-output steps that are being built, indexed by output
+       path. Different derivations can have the same fixed output
+       (e.g. the same tarball fetched from different mirror lists);
+       such steps are not dispatched while one of them is being
+       built, but wait in ‘twins’ to be finished from its result. */
+    struct FixedOutputBuild
+    {
+        Step::wptr step;
+        std::vector<Step::wptr> twins;
+    };
+    Sync<std::map<nix::Path, FixedOutputBuild>> fixedOutputBuilds;
+    counter nrTwinsWaiting{0};
+    counter nrStepsFromTwins{0};
+
+    /* Cache of the BuildOutput of recently seen derivations with
+       valid outputs, in LRU order. */
+    struct CachedBuildOutput
+    {
+        nix::PathSet outputs;
+        BuildOutput output;
+        std::list<nix::Path>::iterator lruPos;
+    };
+    struct BuildOutputCache
+    {
+        std::map<nix::Path, CachedBuildOutput> entries;
+        std::list<nix::Path> lru; // most recently used first
+    };
+    Sync<BuildOutputCache> buildOutputCache;
+    counter nrBuildOutputCacheHits{0};
+    counter nrBuildOutputCacheMisses{0};
 
     /* Log compressor work queue. */
     Sync<std::queue<nix::Path>> logCompressorQueue;
     std::condition_variable_any logCompressorWakeup;
 
+    /* Outputs downloaded from build machines, spooled in
+       ‘nix-store --export’ format, waiting to be compressed into the
+       local binary cache. */
+    Sync<std::queue<nix::Path>> binaryCacheQueue;
+    std::condition_variable_any binaryCacheWakeup;
+    counter nrSpoolFiles{0};
+    counter binaryCacheBacklogBytes{0}; // size of queued spool files
+    counter nrNarsWritten{0};
+    counter bytesNarsWritten{0}; // uncompressed
+    counter bytesNarsCompressed{0};
+    counter totalNarWriteTimeMs{0};
+    counter nrLogsArchived{0};
+    counter bytesLogsArchived{0};
+
     /* Notification sender work queue. FIXME: if hydra-queue-runner is
        killed before it has finished sending notifications about a
        build, then the notifications may be lost. It would be better
@@ -320,6 +677,23 @@ private:
     Sync<std::queue<NotificationItem>> notificationSenderQueue;
     std::condition_variable_any notificationSenderWakeup;
 
+    /* Whether we're a hot standby, i.e. we keep the queue loaded
+       but don't build or write to the database until the active
+       queue runner goes away. */
+    std::atomic_bool standby{false};
+
+    /* Set when the queue monitor should re-read the entire queue. */
+    std::atomic_bool rescanQueue{false};
+
+    /* Held by the queue monitor while it creates the steps of a
+       build, so that revalidateSteps() doesn't see a half-loaded
+       build. */
+    std::mutex queueLoadMutex;
+
+    /* Connection holding the database-level queue runner lock, if
+       enabled. */
+    std::shared_ptr<Connection> advisoryLockConn;
+
     /* Specific build to do for --build-one (testing only). */
     BuildID buildOne;
 
@@ -329,27 +703,72 @@ private:
         unsigned int runnable{0}, running{0};
         system_time lastActive;
         std::chrono::seconds waitTime; // time runnable steps have been waiting
+        nix::Path oldestRunnable; // the step that has been runnable the longest
+        system_time oldestRunnableSince;
     };
 
     Sync<std::map<std::string, MachineType>> machineTypes;
 
+    /* Statistics per required system feature. */
+    struct FeatureStats
+    {
+        unsigned int runnable{0};
+        std::chrono::seconds waitTime{0}; // time runnable steps have been waiting
+        unsigned long nrDispatched{0};
+        unsigned long totalDispatchLatencyMs{0};
+    };
+
+    Sync<std::map<std::string, FeatureStats>> featureStats;
+
     struct MachineReservation
     {
         typedef std::shared_ptr<MachineReservation> ptr;
         State & state;
         Step::ptr step;
         Machine::ptr machine;
-        MachineReservation(State & state, Step::ptr step, Machine::ptr machine);
+        unsigned int cores, memory;
+        time_t startTime;
+        /* Further steps to build after ‘step’ over the same
+           connection. */
+        std::vector<Step::ptr> batch;
+        /* The feature whose reserved slot this is, if any. */
+        std::string reservedFeature;
+        /* The concurrency limits that this reservation counts
+           against. */
+        std::set<StepLimit::ptr> limits;
+        /* The share of the slot charged to each jobset. */
+        std::map<Jobset::ptr, double> charges;
+        MachineReservation(State & state, Step::ptr step, Machine::ptr machine,
+            const std::vector<Step::ptr> & batch = {}, const std::string & reservedFeature = "");
         ~MachineReservation();
     };
 
     std::atomic<time_t> lastDispatcherCheck{0};
 
+    /* The system virtual time of the fair queuing scheduler, i.e. the
+       lowest virtual tag of any jobset with runnable steps. Only
+       advanced by the dispatcher. */
+    std::atomic<double> virtualTime{0};
+
+    /* CPU and wall time used by each kind of thread. */
+    ThreadRoles threadRoles;
+
 public:
     State();
 
 private:
 
+    /* Start a detached thread that runs ‘fn’, registered under
+       ‘role’ in ‘threadRoles’. */
+    template<typename... Args>
+    void startThread(const std::string & role, void (State::*fn)(Args...), Args... args)
+    {
+        std::thread([this, role, fn](Args... args2) {
+            ThreadRoles::Registration registration(threadRoles, role);
+            (this->*fn)(std::move(args2)...);
+        }, std::move(args)...).detach();
+    }
+
     void clearBusy(Connection & conn, time_t stopTime);
 
     void parseMachines(const std::string & contents);
@@ -382,10 +801,17 @@ private:
     /* Handle cancellation, deletion and priority bumps. */
     void processQueueChange(Connection & conn);
 
+    /* Called when a standby queue runner takes over. Remove the
+       steps whose outputs have been built in the meantime (e.g. by
+       the previous queue runner on a shared store), and make the
+       steps that only depended on those runnable. */
+    void revalidateSteps();
+
     Step::ptr createStep(std::shared_ptr<nix::StoreAPI> store,
         Connection & conn, Build::ptr build, const nix::Path & drvPath,
         Build::ptr referringBuild, Step::ptr referringStep, std::set<nix::Path> & finishedDrvs,
-        std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable);
+        std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable,
+        const StepGraph & stepGraph);
 
     Jobset::ptr createJobset(pqxx::work & txn,
         const std::string & projectName, const std::string & jobsetName);
@@ -404,23 +830,96 @@ private:
     void builder(MachineReservation::ptr reservation);
 
     /* Perform the given build step. Return true if the step is to be
-       retried. */
+       retried. If ‘session’ is set, the step is built over that
+       (possibly already open) connection. */
     bool doBuildStep(std::shared_ptr<nix::StoreAPI> store, Step::ptr step,
-        Machine::ptr machine);
+        Machine::ptr machine, std::shared_ptr<RemoteSession> session = 0);
 
     void buildRemote(std::shared_ptr<nix::StoreAPI> store,
         Machine::ptr machine, Step::ptr step,
         unsigned int maxSilentTime, unsigned int buildTimeout,
-        RemoteResult & result);
+        RemoteResult & result, std::shared_ptr<RemoteSession> session = 0);
+
+    /* Create a session for building ‘steps’ one after another over a
+       single connection. The connection is opened, and the inputs of
+       all steps copied, when the first step is built. */
+    std::shared_ptr<RemoteSession> createSession(const std::vector<Step::ptr> & steps);
+
+    void openSession(std::shared_ptr<nix::StoreAPI> store, Machine::ptr machine,
+        RemoteSession & session, const nix::Path & logFile);
+
+    /* Whether a step is expected to finish within ‘maxDuration’
+       seconds, based on how long it took previously. */
+    bool isShortStep(Step::ptr step, unsigned int maxDuration);
+
+    /* Whether a step is expected to finish within
+       ‘batchStepMaxDuration’ seconds. */
+    bool isSmallStep(Step::ptr step)
+    {
+        return isShortStep(step, batchStepMaxDuration);
+    }
+
+    void noteStepDuration(Step::ptr step, time_t duration);
+
+    /* Return the BuildOutput of the derivation ‘drvPath’, whose
+       outputs must be valid. A cached result is reused if all of its
+       output paths are still valid. If ‘drv’ is null, the derivation
+       is only read on a cache miss. */
+    BuildOutput getBuildOutputCached(std::shared_ptr<nix::StoreAPI> store,
+        const nix::Path & drvPath, const nix::Derivation * drv = 0);
 
     void markSucceededBuild(pqxx::work & txn, Build::ptr build,
         const BuildOutput & res, bool isCachedBuild, time_t startTime, time_t stopTime);
 
     bool checkCachedFailure(Step::ptr step, Connection & conn);
 
+    /* Whether starting ‘step’ would stay within the concurrency
+       limits of at least one of its jobsets (and of its project). */
+    bool withinStepLimits(Step::ptr step);
+
+    /* The aging level of a step that has been runnable for
+       ‘waitTime’. */
+    unsigned int agingLevel(std::chrono::seconds waitTime);
+
+    /* If another step with the same fixed output as ‘step’ is being
+       built, remove ‘step’ from the runnable queue and let it wait
+       for that step. */
+    bool waitForTwin(Step::ptr step);
+
+    /* Called after building a fixed-output step. Return the steps
+       that were waiting for it. */
+    std::vector<Step::ptr> releaseTwins(Step::ptr step);
+
+    /* Return a connection for read-only queries. This is a
+       connection to the replica, if there is one and it's not lagging
+       too far behind; otherwise it's a connection to the primary.
+       Queries whose results must include the latest writes (such as
+       the set of queued builds) must use the primary. */
+    ReadOnlyConnection getReadOnlyConnection();
+
+    /* Thread that copies the input closures of runnable steps to the
+       machines on which they are expected to run. */
+    void prefetcher();
+
+    /* Update the prefetch statistics when ‘step’ is about to be
+       built on ‘machine’. */
+    void notePrefetchUse(Step::ptr step, Machine::ptr machine);
+
     /* Thread that asynchronously bzips logs of finished steps. */
     void logCompressor();
 
+    /* Thread that periodically moves old compressed logs into packed
+       archives, to reduce the number of files in ‘build-logs’. */
+    void logArchiver();
+
+    void archiveLogs(const std::string & bucket, time_t cutoff);
+
+    /* Threads that turn spooled outputs into compressed NARs and
+       narinfo files in the local binary cache. */
+    void binaryCacheWriter();
+
+    void writeSpoolFile(std::shared_ptr<nix::StoreAPI> store, const nix::Path & spoolFile);
+
     /* Thread that asynchronously invokes hydra-notify to send build
        notifications. */
     void notificationSender();
@@ -429,13 +928,36 @@ private:
        has it. */
     std::shared_ptr<nix::PathLocks> acquireGlobalLock();
 
+    /* Acquire the PostgreSQL advisory lock that guarantees a single
+       active queue runner among hosts sharing the database, if
+       ‘queue_runner_advisory_lock’ is enabled in hydra.conf. Return
+       false if somebody else has it. */
+    bool acquireAdvisoryLock();
+
+    /* Thread that checks that we still hold the advisory lock, and
+       exits if we don't (e.g. because its connection was lost). */
+    void monitorAdvisoryLock();
+
     void dumpStatus(Connection & conn, bool log);
 
+    /* Walk the in-memory build graph, the machines and the work
+       queues, and write the number of objects and an estimate of
+       their memory use, broken down by jobset and system type, to
+       the SystemStatus table. This locks every step, so it's only
+       done on request (‘hydra-queue-runner --census’). */
+    void dumpCensus(Connection & conn);
+
+    /* The time and total estimated size of the last census. */
+    std::atomic<time_t> lastCensus{0};
+    counter lastCensusBytes{0};
+
 public:
 
-    void showStatus();
+    /* Print the status dump (or, if ‘census’ is set, the object
+       census) of the running queue runner. */
+    void showStatus(bool census = false);
 
     void unlock();
 
-    void run(BuildID buildOne = 0);
+    void run(BuildID buildOne = 0, bool standbyMode = false);
 };
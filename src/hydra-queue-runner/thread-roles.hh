@@ -0,0 +1,144 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "sync.hh"
+#include "util.hh"
+
+/* A registry of the threads of the queue runner, grouped by role
+   (such as ‘dispatcher’ or ‘builder’). It keeps track of the CPU time
+   and wall time of each role, to show whether its threads are
+   CPU-bound or mostly blocked on I/O and locks. */
+class ThreadRoles
+{
+public:
+
+    struct Totals
+    {
+        unsigned int nrThreads = 0; // currently running
+        double cpuTime = 0, wallTime = 0; // seconds, summed over threads
+    };
+
+    struct Sample
+    {
+        Totals total;
+        Totals recent; // over the last one to two sample periods
+    };
+
+private:
+
+    typedef std::chrono::steady_clock clock;
+
+    struct Thread
+    {
+        std::string role;
+        clockid_t cpuClock;
+        clock::time_point startTime;
+    };
+
+    struct State
+    {
+        unsigned long nextId = 0;
+        std::map<unsigned long, Thread> threads;
+        std::map<std::string, Totals> finished; // threads that have exited
+        /* The totals at the last two checkpoints. A checkpoint is
+           taken by sample() once every ‘samplePeriod’ seconds, so
+           the recent totals don't depend on how often it's
+           called. */
+        std::map<std::string, Totals> previous, checkpoint;
+        clock::time_point checkpointTime = clock::now();
+    };
+
+    static constexpr double samplePeriod = 60;
+
+    Sync<State> state;
+
+    static double getCpuTime(clockid_t cpuClock)
+    {
+        struct timespec ts;
+        if (clock_gettime(cpuClock, &ts) == -1) return 0;
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    static double secondsSince(clock::time_point t)
+    {
+        return std::chrono::duration<double>(clock::now() - t).count();
+    }
+
+public:
+
+    /* Register the calling thread under ‘role’ for as long as this
+       object exists. */
+    class Registration
+    {
+        ThreadRoles & roles;
+        unsigned long id;
+
+    public:
+
+        Registration(ThreadRoles & roles, const std::string & role)
+            : roles(roles)
+        {
+            Thread thread;
+            thread.role = role;
+            if (pthread_getcpuclockid(pthread_self(), &thread.cpuClock) != 0)
+                throw nix::Error("cannot get the CPU clock of the current thread");
+            thread.startTime = clock::now();
+            auto state_(roles.state.lock());
+            id = state_->nextId++;
+            state_->threads[id] = thread;
+        }
+
+        ~Registration()
+        {
+            auto state_(roles.state.lock());
+            auto i = state_->threads.find(id);
+            auto & totals(state_->finished[i->second.role]);
+            totals.cpuTime += getCpuTime(i->second.cpuClock);
+            totals.wallTime += secondsSince(i->second.startTime);
+            state_->threads.erase(i);
+        }
+    };
+
+    /* Return the totals per role, as well as the recent totals
+       (since the checkpoint before the last one). */
+    std::map<std::string, Sample> sample()
+    {
+        auto state_(state.lock());
+
+        std::map<std::string, Totals> totals(state_->finished);
+        for (auto & totals2 : totals) totals2.second.nrThreads = 0;
+
+        for (auto & i : state_->threads) {
+            auto & t(totals[i.second.role]);
+            t.nrThreads++;
+            t.cpuTime += getCpuTime(i.second.cpuClock);
+            t.wallTime += secondsSince(i.second.startTime);
+        }
+
+        std::map<std::string, Sample> res;
+        for (auto & i : totals) {
+            auto & s(res[i.first]);
+            s.total = i.second;
+            s.recent = i.second;
+            auto j = state_->previous.find(i.first);
+            if (j != state_->previous.end()) {
+                s.recent.cpuTime -= j->second.cpuTime;
+                s.recent.wallTime -= j->second.wallTime;
+            }
+        }
+
+        if (secondsSince(state_->checkpointTime) >= samplePeriod) {
+            state_->previous = state_->checkpoint;
+            state_->checkpoint = totals;
+            state_->checkpointTime = clock::now();
+        }
+
+        return res;
+    }
+};
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "db.hh"
+#include "hydra-config.hh"
+
+#include "shared.hh"
+#include "globals.hh"
+#include "store-api.hh"
+
+using namespace nix;
+
+
+/* Register the outputs and derivations of the builds that Hydra wants
+   to keep as GC roots, and remove the roots of all other builds. A GC
+   root is an empty file in the roots directory named after the base
+   name of the store path. */
+
+
+/* Don't delete roots that are less than a day old, to prevent a race
+   where hydra-eval-jobs has added a root but the evaluator hasn't
+   added the build to the database yet. */
+static const time_t minRootAge = 24 * 60 * 60;
+
+
+static Path getGCRootsDir(std::map<std::string, std::string> & hydraConfig)
+{
+    Path dir = hydraConfig["gc_roots_dir"];
+    if (dir == "") {
+        auto user = getEnv("LOGNAME");
+        if (user == "") throw Error("$LOGNAME must be set");
+        dir = getEnv("NIX_STATE_DIR", "/nix/var/nix") + "/gcroots/per-user/" + user + "/hydra-roots";
+    }
+    createDirs(dir);
+    return dir;
+}
+
+
+/* Run ‘fun’ on each element of ‘items’ using ‘nrThreads’ threads. */
+template<typename T>
+static void parallelForEach(const std::vector<T> & items, unsigned int nrThreads,
+    std::function<void(const T &)> fun)
+{
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (unsigned int n = 0; n < std::max(nrThreads, 1U); n++)
+        threads.emplace_back([&]() {
+            while (true) {
+                size_t i = next++;
+                if (i >= items.size()) break;
+                try {
+                    fun(items[i]);
+                } catch (std::exception & e) {
+                    printMsg(lvlError, format("%1%") % e.what());
+                }
+            }
+        });
+    for (auto & thread : threads) thread.join();
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        unsigned int nrThreads = std::thread::hardware_concurrency();
+        bool dryRun = false;
+
+        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--jobs" || *arg == "-j") {
+                if (!string2Int(getArg(*arg, arg, end), nrThreads))
+                    throw UsageError("‘--jobs’ requires an integer argument");
+            } else if (*arg == "--dry-run")
+                dryRun = true;
+            else
+                return false;
+            return true;
+        });
+
+        auto hydraConfig = getHydraConfig();
+        Path gcRootsDir = getGCRootsDir(hydraConfig);
+
+        /* Read the current GC roots. */
+        printMsg(lvlInfo, "reading current roots...");
+        std::set<std::string> currentRoots;
+        for (auto & i : readDirectory(gcRootsDir))
+            currentRoots.insert(i.name);
+
+        /* Compute the set of builds to keep. For each build, we also
+           record whether to keep its derivation if it failed, so that
+           it can be restarted. */
+        printMsg(lvlInfo, "computing the builds to keep...");
+
+        Connection conn;
+        pqxx::work txn(conn);
+
+        txn.exec("create temporary table KeptBuilds (id integer not null, keepFailedDrvs integer not null) on commit drop");
+
+        /* Scheduled builds, release members and builds that have been
+           marked as "keep". */
+        txn.exec
+            ("insert into KeptBuilds "
+             "select id, 0 from Builds where finished = 0 "
+             "union all select build, 0 from ReleaseMembers "
+             "union all select id, 0 from Builds where finished = 1 and keep = 1");
+
+        /* For every jobset, all builds in the unfinished and ‘keepnr’
+           most recent finished evaluations, and the most recent
+           successful build of every job in those evaluations. Jobsets
+           that have been hidden and disabled for more than a week are
+           skipped. */
+        txn.parameterized
+            ("with "
+             "  keptJobsets as ("
+             "    select j.project, j.name, j.keepnr from Jobsets j join Projects p on p.name = j.project "
+             "    where not (j.enabled = 0 and (p.hidden = 1 or j.hidden = 1) and $1 - coalesce(j.lastCheckedTime, 0) > 7 * 24 * 3600)), "
+             "  unfinishedEvals as ("
+             "    select distinct m.eval as id from Builds b "
+             "    join JobsetEvalMembers m on m.build = b.id "
+             "    join keptJobsets j on b.project = j.project and b.jobset = j.name "
+             "    where b.finished = 0), "
+             "  recentEvals as ("
+             "    select id from ("
+             "      select e.id, j.keepnr, row_number() over (partition by e.project, e.jobset order by e.id desc) as n "
+             "      from JobsetEvals e join keptJobsets j on e.project = j.project and e.jobset = j.name "
+             "      where e.hasNewBuilds = 1 and not exists "
+             "        (select 1 from Builds b join JobsetEvalMembers m on b.id = m.build where m.eval = e.id and b.finished = 0)"
+             "    ) x where n <= keepnr), "
+             "  evals as (select id from unfinishedEvals union select id from recentEvals), "
+             "  evalBuilds as ("
+             "    select b.id, b.project, b.jobset, b.job, b.finished from Builds b "
+             "    join JobsetEvalMembers m on m.build = b.id where m.eval in (select id from evals)) "
+             "insert into KeptBuilds "
+             "select id, 1 from evalBuilds where finished = 1 "
+             "union all "
+             "select max(b.id), 1 from Builds b "
+             "where b.finished = 1 and b.buildStatus in (0, 6) "
+             "  and (b.project, b.jobset, b.job) in (select distinct project, jobset, job from evalBuilds) "
+             "group by b.project, b.jobset, b.job")
+            (time(0)).exec();
+
+        PathSet keep;
+
+        /* The outputs of successful builds. */
+        auto res = txn.exec
+            ("select distinct o.path from KeptBuilds k "
+             "join Builds b on b.id = k.id join BuildOutputs o on o.build = b.id "
+             "where b.finished = 1 and b.buildStatus in (0, 6)");
+        for (auto const & row : res)
+            keep.insert(row[0].as<std::string>());
+        size_t nrOutputs = keep.size();
+
+        /* The derivations of scheduled builds, and of failed builds
+           that may be restarted. */
+        res = txn.exec
+            ("select distinct b.drvPath from KeptBuilds k join Builds b on b.id = k.id "
+             "where b.finished = 0 or (k.keepFailedDrvs = 1 and b.buildStatus != 0)");
+        for (auto const & row : res)
+            keep.insert(row[0].as<std::string>());
+
+        txn.commit();
+
+        printMsg(lvlInfo, format("keeping %1% outputs and %2% derivations") % nrOutputs % (keep.size() - nrOutputs));
+
+        /* Only register roots for paths that still exist. */
+        auto store = openStore();
+        auto valid = store->queryValidPaths(keep);
+        if (valid.size() != keep.size())
+            printMsg(lvlInfo, format("%1% kept paths have disappeared") % (keep.size() - valid.size()));
+
+        std::set<std::string> wantedRoots;
+        for (auto & path : valid)
+            wantedRoots.insert(baseNameOf(path));
+
+        /* Diff the wanted roots against the current ones. */
+        std::vector<std::string> toAdd, toRemove;
+        std::set_difference(wantedRoots.begin(), wantedRoots.end(),
+            currentRoots.begin(), currentRoots.end(), std::back_inserter(toAdd));
+        std::set_difference(currentRoots.begin(), currentRoots.end(),
+            wantedRoots.begin(), wantedRoots.end(), std::back_inserter(toRemove));
+
+        printMsg(lvlInfo, format("adding %1% roots, considering %2% roots for removal")
+            % toAdd.size() % toRemove.size());
+
+        if (dryRun) {
+            for (auto & name : toAdd)
+                std::cout << "add " << name << "\n";
+            for (auto & name : toRemove)
+                std::cout << "remove " << name << "\n";
+            return;
+        }
+
+        std::atomic<size_t> nrAdded{0}, nrDeleted{0}, nrRecent{0};
+        time_t now = time(0);
+
+        parallelForEach<std::string>(toAdd, nrThreads, [&](const std::string & name) {
+            Path link = gcRootsDir + "/" + name;
+            AutoCloseFD fd = open(link.c_str(), O_CREAT | O_WRONLY, 0644);
+            if (fd == -1) throw SysError(format("creating GC root ‘%1%’") % link);
+            nrAdded++;
+        });
+
+        parallelForEach<std::string>(toRemove, nrThreads, [&](const std::string & name) {
+            Path link = gcRootsDir + "/" + name;
+            struct stat st;
+            if (lstat(link.c_str(), &st) == -1) {
+                if (errno == ENOENT) return;
+                throw SysError(format("getting status of ‘%1%’") % link);
+            }
+            if (st.st_ctime >= now - minRootAge) {
+                nrRecent++;
+                return;
+            }
+            printMsg(lvlTalkative, format("removing root ‘%1%’") % name);
+            if (unlink(link.c_str()) == -1 && errno != ENOENT)
+                throw SysError(format("removing GC root ‘%1%’") % link);
+            nrDeleted++;
+        });
+
+        printMsg(lvlInfo, format("added %1% roots, deleted %2% roots, kept %3% recent roots; %4% roots in total")
+            % (size_t) nrAdded % (size_t) nrDeleted % (size_t) nrRecent
+            % (currentRoots.size() + nrAdded - nrDeleted));
+    });
+}
@@ -143,15 +143,15 @@ sub showLog {
     notFound($c, "The build log of derivation ‘$drvPath’ is not available.") unless defined $logPath;
 
     # Don't send logs that we can't stream.
-    my $size = stat($logPath)->size; # FIXME: not so meaningful for compressed logs
+    my $size = logSize($logPath); # FIXME: not so meaningful for compressed logs
     error($c, "This build log is too big to display ($size bytes).") unless
         $mode eq "raw"
-        || (($mode eq "tail" || $mode eq "tail-reload") && $logPath !~ /\.bz2$/)
+        || (($mode eq "tail" || $mode eq "tail-reload") && !isCompressedLog($logPath))
         || $size < 64 * 1024 * 1024;
 
     if ($mode eq "pretty") {
         # !!! quick hack
-        my $pipeline = ($logPath =~ /.bz2$/ ? "bzip2 -d < $logPath" : "cat $logPath")
+        my $pipeline = logCommand($logPath)
             . " | nix-log2xml | xsltproc " . $c->path_to("xsl/mark-errors.xsl") . " -"
             . " | xsltproc " . $c->path_to("xsl/log2html.xsl") . " -";
         $c->stash->{template} = 'log.tt';
@@ -16,12 +16,15 @@ use File::Path;
 use File::Temp;
 use File::Spec;
 use File::Slurp;
+use IO::Socket::UNIX;
+use POSIX;
+use Time::HiRes;
 use Hydra::Helper::PluginHooks;
 use Hydra::Helper::CatalystUtils;
 
 our @ISA = qw(Exporter);
 our @EXPORT = qw(
-    fetchInput evalJobs checkBuild inputsToArgs
+    fetchInput evalJobs importEval inputsToArgs
     restartBuild getPrevJobsetEval
 );
 
@@ -323,8 +326,12 @@ sub inputsToArgs {
 }
 
 
+# Maximum duration of an evaluation, in seconds.
+my $evalTimeout = 10800;
+
+
 sub evalJobs {
-    my ($inputInfo, $exprType, $nixExprInputName, $nixExprPath) = @_;
+    my ($inputInfo, $exprType, $nixExprInputName, $nixExprPath, $stepGraph) = @_;
 
     my $nixExprInput = $inputInfo->{$nixExprInputName}->[0]
         or die "cannot find the input containing the job expression\n";
@@ -336,6 +343,11 @@ sub evalJobs {
 
     my @cmd = ($evaluator, $nixExprFullPath, "--gc-roots-dir", getGCRootsDir, "-j", 1, inputsToArgs($inputInfo, $exprType));
 
+    # Optionally let the evaluator write the dependency graph of the
+    # jobs, so that the queue runner doesn't have to read every
+    # derivation.
+    push @cmd, "--step-graph", $stepGraph if defined $stepGraph && $exprType eq "nix";
+
     if (defined $ENV{'HYDRA_DEBUG'}) {
         sub escape {
             my $s = $_;
@@ -346,7 +358,17 @@ sub evalJobs {
         print STDERR "evaluator: @escaped\n";
     }
 
-    (my $res, my $jobsJSON, my $stderr) = captureStdoutStderr(10800, @cmd);
+    # If configured, use a persistent evaluation server that keeps
+    # previously parsed Nix expressions in memory. hydra-evaluator
+    # disables it when running concurrent evaluations.
+    my $config = getHydraConfig();
+    if (defined $config->{eval_server_socket} && $evaluator eq "hydra-eval-jobs" && !$ENV{'HYDRA_NO_EVAL_SERVER'}) {
+        my $jobsJSON = evalJobsViaServer($config->{eval_server_socket}, $config->{eval_server_max_heap_size}, $evalTimeout, @cmd[1..$#cmd]);
+        return (decode_json($jobsJSON), $nixExprInput) if defined $jobsJSON;
+        print STDERR "cannot use the evaluation server, falling back to $evaluator\n";
+    }
+
+    (my $res, my $jobsJSON, my $stderr) = captureStdoutStderr($evalTimeout, @cmd);
     die "$evaluator returned " . ($res & 127 ? "signal $res" : "exit code " . ($res >> 8))
         . ":\n" . ($stderr ? decode("utf-8", $stderr) : "(no output)\n")
         if $res;
@@ -357,114 +379,110 @@ sub evalJobs {
 }
 
 
-# Return the most recent evaluation of the given jobset (that
-# optionally had new builds), or undefined if no such evaluation
-# exists.
-sub getPrevJobsetEval {
-    my ($db, $jobset, $hasNewBuilds) = @_;
-    my ($prevEval) = $jobset->jobsetevals(
-        ($hasNewBuilds ? { hasnewbuilds => 1 } : { }),
-        { order_by => "id DESC", rows => 1 });
-    return $prevEval;
+sub connectEvalServer {
+    my ($socketPath) = @_;
+    return IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socketPath);
 }
 
 
-# Check whether to add the build described by $buildInfo.
-sub checkBuild {
-    my ($db, $jobset, $inputInfo, $nixExprInput, $buildInfo, $buildMap, $prevEval, $jobOutPathMap, $plugins) = @_;
-
-    my @outputNames = sort keys %{$buildInfo->{outputs}};
-    die unless scalar @outputNames;
-
-    # In various checks we can use an arbitrary output (the first)
-    # rather than all outputs, since if one output is the same, the
-    # others will be as well.
-    my $firstOutputName = $outputNames[0];
-    my $firstOutputPath = $buildInfo->{outputs}->{$firstOutputName};
-
-    my $jobName = $buildInfo->{jobName} or die;
-    my $drvPath = $buildInfo->{drvPath} or die;
-
-    my $build;
-
-    txn_do($db, sub {
-        my $job = $jobset->jobs->update_or_create({ name => $jobName });
-
-        # Don't add a build that has already been scheduled for this
-        # job, or has been built but is still a "current" build for
-        # this job.  Note that this means that if the sources of a job
-        # are changed from A to B and then reverted to A, three builds
-        # will be performed (though the last one will probably use the
-        # cached result from the first).  This ensures that the builds
-        # with the highest ID will always be the ones that we want in
-        # the channels.  FIXME: Checking the output paths doesn't take
-        # meta-attributes into account.  For instance, do we want a
-        # new build to be scheduled if the meta.maintainers field is
-        # changed?
-        if (defined $prevEval) {
-            # Only check one output: if it's the same, the other will be as well.
-            my $firstOutput = $outputNames[0];
-            my ($prevBuild) = $prevEval->builds->search(
-                # The "project" and "jobset" constraints are
-                # semantically unnecessary (because they're implied by
-                # the eval), but they give a factor 1000 speedup on
-                # the Nixpkgs jobset with PostgreSQL.
-                { project => $jobset->project->name, jobset => $jobset->name, job => $jobName,
-                  name => $firstOutputName, path => $firstOutputPath },
-                { rows => 1, columns => ['id'], join => ['buildoutputs'] });
-            if (defined $prevBuild) {
-                #print STDERR "    already scheduled/built as build ", $prevBuild->id, "\n";
-                $buildMap->{$prevBuild->id} = { id => $prevBuild->id, jobName => $jobName, new => 0, drvPath => $drvPath };
-                return;
-            }
+# Send an evaluation request to the hydra-eval-jobs server listening
+# on $socketPath, starting the server if necessary.  Return the JSON
+# job set, or undef if the server could not be reached.  The server
+# aborts the evaluation after $timeout seconds; we give up a bit
+# later, since the request may have to wait for another evaluation.
+sub evalJobsViaServer {
+    my ($socketPath, $maxHeapSize, $timeout, @args) = @_;
+
+    my $sock = connectEvalServer($socketPath);
+
+    unless (defined $sock) {
+        # Start a detached server.
+        my $pid = fork;
+        return undef unless defined $pid;
+        if ($pid == 0) {
+            POSIX::setsid();
+            POSIX::_exit(0) if fork != 0;
+            open STDIN, "</dev/null";
+            exec("hydra-eval-jobs", "--server", $socketPath,
+                 (defined $maxHeapSize ? ("--max-heap-size", $maxHeapSize) : ()));
+            POSIX::_exit(1);
         }
+        waitpid($pid, 0);
 
-        # Prevent multiple builds with the same (job, outPath) from
-        # being added.
-        my $prev = $$jobOutPathMap{$jobName . "\t" . $firstOutputPath};
-        if (defined $prev) {
-            #print STDERR "    already scheduled as build ", $prev, "\n";
-            return;
+        for (my $n = 0; $n < 100 && !defined $sock; $n++) {
+            Time::HiRes::sleep(0.1);
+            $sock = connectEvalServer($socketPath);
         }
+        return undef unless defined $sock;
+    }
 
-        my $time = time();
+    my $response;
+    eval {
+        local $SIG{ALRM} = sub { die "timeout\n" };
+        alarm($timeout + 60);
+        print $sock join("\0", @args, "--timeout", $timeout);
+        $sock->shutdown(1);
+        $response = do { local $/; <$sock> };
+        alarm 0;
+    };
+    alarm 0;
+    close $sock;
+    die "evaluation server did not respond within " . ($timeout + 60) . " seconds\n" if $@ eq "timeout\n";
+    die $@ if $@;
+
+    return undef unless defined $response;
+
+    if ($response =~ s/^error (\d+)\n//) {
+        my $stderr = substr($response, 0, $1, "");
+        die "evaluation server: $response\n" . ($stderr ne "" ? decode("utf-8", $stderr) : "");
+    }
 
-        sub null {
-            my ($s) = @_;
-            return $s eq "" ? undef : $s;
-        }
+    return undef unless $response =~ s/^ok (\d+) (\d+) (\d+)\n//;
+    print STDERR "evaluation server took $1 ms, saving an estimated $2 ms\n";
+    print STDERR substr($response, 0, $3, "");
 
-        # Add the build to the database.
-        $build = $job->builds->create(
-            { timestamp => $time
-            , description => null($buildInfo->{description})
-            , license => null($buildInfo->{license})
-            , homepage => null($buildInfo->{homepage})
-            , maintainers => null($buildInfo->{maintainers})
-            , maxsilent => $buildInfo->{maxSilent}
-            , timeout => $buildInfo->{timeout}
-            , nixname => $buildInfo->{nixName}
-            , drvpath => $drvPath
-            , system => $buildInfo->{system}
-            , nixexprinput => $jobset->nixexprinput
-            , nixexprpath => $jobset->nixexprpath
-            , priority => $buildInfo->{schedulingPriority}
-            , finished => 0
-            , iscurrent => 1
-            , ischannel => $buildInfo->{isChannel}
-            });
+    return $response;
+}
 
-        $build->buildoutputs->create({ name => $_, path => $buildInfo->{outputs}->{$_} })
-            foreach @outputNames;
 
-        $buildMap->{$build->id} = { id => $build->id, jobName => $jobName, new => 1, drvPath => $drvPath };
-        $$jobOutPathMap{$jobName . "\t" . $firstOutputPath} = $build->id;
+# Return the most recent evaluation of the given jobset (that
+# optionally had new builds), or undefined if no such evaluation
+# exists.
+sub getPrevJobsetEval {
+    my ($db, $jobset, $hasNewBuilds) = @_;
+    my ($prevEval) = $jobset->jobsetevals(
+        ($hasNewBuilds ? { hasnewbuilds => 1 } : { }),
+        { order_by => "id DESC", rows => 1 });
+    return $prevEval;
+}
 
-        print STDERR "added build ${\$build->id} (${\$jobset->project->name}:${\$jobset->name}:$jobName)\n";
-    });
 
-    return $build;
-};
+# Add the builds of an evaluation of $jobset, and the evaluation
+# itself, to the database.  This is done in bulk by
+# hydra-import-eval, in a single transaction.  If the evaluation has
+# new builds, the step graph $stepGraph (if defined) is renamed to the
+# ID of the evaluation before the transaction commits.  Return the ID
+# of the new evaluation, and whether it has any new builds.
+sub importEval {
+    my ($jobset, $jobs, $inputInfo, $argsHash, $checkoutTime, $evalTime, $stepGraph) = @_;
+
+    my $tmpDir = File::Temp->newdir(CLEANUP => 1);
+    write_file("$tmpDir/jobs.json", encode_json($jobs));
+    write_file("$tmpDir/inputs.json", JSON->new->allow_blessed->encode($inputInfo));
+
+    (my $res, my $stdout, my $stderr) = captureStdoutStderr(3600,
+        "hydra-import-eval",
+        "--project", $jobset->get_column('project'), "--jobset", $jobset->name,
+        "--hash", $argsHash, "--inputs", "$tmpDir/inputs.json",
+        "--checkout-time", $checkoutTime, "--eval-time", $evalTime,
+        (defined $stepGraph ? ("--step-graph", $stepGraph) : ()),
+        "$tmpDir/jobs.json");
+    print STDERR $stderr if defined $stderr;
+    die "hydra-import-eval returned " . ($res & 127 ? "signal $res" : "exit code " . ($res >> 8)) . "\n"
+        if $res;
 
+    $stdout =~ /^(\d+) ([01])$/m or die "unexpected output from hydra-import-eval: $stdout\n";
+    return ($1, $2);
+}
 
 1;
@@ -18,6 +18,7 @@ our @EXPORT = qw(
     registerRoot getGCRootsDir gcRootFor
     jobsetOverview jobsetOverview_
     removeAsciiEscapes getDrvLogPath findLog logContents
+    logCommand logSize isCompressedLog
     getMainOutput
     getEvals getMachines
     pathIsInsidePrefix
@@ -145,7 +146,10 @@ sub jobsetOverview {
 
 
 # Return the path of the build log of the given derivation, or undef
-# if the log is gone.
+# if the log is gone. If the log has been moved into a packed log
+# archive by the queue runner, return a hash reference denoting its
+# location in the archive instead. Use logCommand(), logSize() and
+# isCompressedLog() to access either kind of log.
 sub getDrvLogPath {
     my ($drvPath) = @_;
     my $base = basename $drvPath;
@@ -155,6 +159,39 @@ sub getDrvLogPath {
     for ($fn2 . $bucketed, $fn2 . $bucketed . ".bz2", $fn . $bucketed . ".bz2", $fn . $bucketed, $fn . $base . ".bz2", $fn . $base) {
         return $_ if -f $_;
     }
+    return findPackedLog($drvPath);
+}
+
+
+# Look up the log of the given derivation in the packed log archives
+# in build-logs/packs/<bucket>/. Each <n>.idx file is a sorted list
+# of 64-byte records "<drv hash> <offset> <length>\n", with the offset
+# and length in hex, pointing into <n>.pack. Newer packs take
+# precedence.
+sub findPackedLog {
+    my ($drvPath) = @_;
+    my $hash = substr(basename($drvPath), 0, 32);
+    my $dir = Hydra::Model::DB::getHydraPath . "/build-logs/packs/" . substr($hash, 0, 2);
+
+    opendir my $dh, $dir or return undef;
+    my @packs = sort { $b <=> $a } map { /^(\d+)\.idx$/ ? $1 : () } readdir $dh;
+    closedir $dh;
+
+    foreach my $n (@packs) {
+        open my $fh, "<", "$dir/$n.idx" or next;
+        my ($lo, $hi) = (0, int((-s $fh) / 64));
+        while ($lo < $hi) {
+            my $mid = int(($lo + $hi) / 2);
+            seek $fh, $mid * 64, 0 or last;
+            read($fh, my $record, 64) == 64 or last;
+            my ($h, $offset, $length) = split / /, substr($record, 0, 63);
+            if ($h eq $hash) {
+                return { pack => "$dir/$n.pack", offset => hex($offset), length => hex($length) };
+            }
+            if ($h lt $hash) { $lo = $mid + 1; } else { $hi = $mid; }
+        }
+    }
+
     return undef;
 }
 
@@ -188,11 +225,36 @@ sub findLog {
 }
 
 
+# Return a shell command that writes the uncompressed contents of the
+# given log to stdout.
+sub logCommand {
+    my ($logPath) = @_;
+    if (ref $logPath) {
+        return "tail -c +" . ($logPath->{offset} + 1) . " < $logPath->{pack} | head -c $logPath->{length} | bzip2 -d";
+    }
+    return $logPath =~ /\.bz2$/ ? "bzip2 -d < $logPath" : "cat $logPath";
+}
+
+
+# Return the size of the given log as stored (i.e. compressed, if
+# applicable).
+sub logSize {
+    my ($logPath) = @_;
+    return ref $logPath ? $logPath->{length} : -s $logPath;
+}
+
+
+sub isCompressedLog {
+    my ($logPath) = @_;
+    return ref $logPath || $logPath =~ /\.bz2$/;
+}
+
+
 sub logContents {
     my ($logPath, $tail) = @_;
     my $cmd;
-    if ($logPath =~ /.bz2$/) {
-        $cmd = "bzip2 -d < $logPath";
+    if (isCompressedLog($logPath)) {
+        $cmd = logCommand($logPath);
         $cmd = $cmd . " | tail -n $tail" if defined $tail;
     }
     else {
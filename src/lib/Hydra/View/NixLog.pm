@@ -3,6 +3,7 @@ package Hydra::View::NixLog;
 use strict;
 use base qw/Catalyst::View/;
 use Hydra::Helper::CatalystUtils;
+use Hydra::Helper::Nix;
 
 sub process {
     my ($self, $c) = @_;
@@ -13,8 +14,8 @@ sub process {
 
     my $fh = new IO::Handle;
 
-    if ($logPath =~ /\.bz2$/) {
-        open $fh, "bzip2 -dc < '$logPath' |" or die;
+    if (isCompressedLog($logPath)) {
+        open $fh, logCommand($logPath) . " |" or die;
     } else {
         open $fh, "<$logPath" or die;
     }
@@ -7,20 +7,28 @@
 
 struct Connection : pqxx::connection
 {
-    Connection() : pqxx::connection(getFlags()) { };
+    Connection(const std::string & var = "HYDRA_DBI") : pqxx::connection(getFlags(var)) { };
 
-    std::string getFlags()
+    static std::string getFlags(const std::string & var)
     {
         using namespace nix;
-        auto s = getEnv("HYDRA_DBI", "dbi:Pg:dbname=hydra;");
+        auto s = getEnv(var, "dbi:Pg:dbname=hydra;");
         std::string prefix = "dbi:Pg:";
         if (std::string(s, 0, prefix.size()) != prefix)
-            throw Error("$HYDRA_DBI does not denote a PostgreSQL database");
+            throw Error(format("$%1% does not denote a PostgreSQL database") % var);
         return concatStringsSep(" ", tokenizeString<Strings>(string(s, prefix.size()), ";"));
     }
 };
 
 
+/* A connection to a read-only replica of the database, given by
+   $HYDRA_DBI_RO. */
+struct ReplicaConnection : Connection
+{
+    ReplicaConnection() : Connection("HYDRA_DBI_RO") { };
+};
+
+
 struct receiver : public pqxx::notification_receiver
 {
     bool status = false;
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <map>
+
+#include "util.hh"
+
+
+/* Read hydra.conf. Only simple ‘key = value’ settings are
+   supported. */
+static inline std::map<std::string, std::string> getHydraConfig()
+{
+    using namespace nix;
+
+    std::map<std::string, std::string> hydraConfig;
+
+    auto hydraConfigFile = getEnv("HYDRA_CONFIG");
+    if (pathExists(hydraConfigFile)) {
+        for (auto line : tokenizeString<Strings>(readFile(hydraConfigFile), "\n")) {
+            line = trim(string(line, 0, line.find('#')));
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            auto key = trim(std::string(line, 0, eq));
+            auto value = trim(std::string(line, eq + 1));
+            if (key == "") continue;
+            hydraConfig[key] = value;
+        }
+    }
+
+    return hydraConfig;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <map>
+
+#include "derivations.hh"
+#include "serialise.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+/* A step graph is a compact binary file, written by hydra-eval-jobs,
+   that describes every derivation in the closure of the jobs of an
+   evaluation. It contains just enough of each derivation (outputs,
+   input derivations, input sources, platform and the environment
+   variables that affect scheduling) for the queue runner to create
+   build steps without parsing the .drv files. The full derivation is
+   only read when a step is actually built. */
+
+typedef std::map<nix::Path, nix::Derivation> StepGraph;
+
+const unsigned int stepGraphMagic = 0x48534731; // "HSG1"
+
+/* The environment variables that are kept in a step graph. */
+static const nix::StringSet stepGraphEnvVars = { "requiredSystemFeatures", "preferLocalBuild" };
+
+
+static inline void writeStepGraph(const nix::Path & fileName, const StepGraph & graph)
+{
+    using namespace nix;
+
+    StringSink sink;
+    sink << stepGraphMagic << graph.size();
+
+    for (auto & i : graph) {
+        auto & drv(i.second);
+        sink << i.first << drv.platform;
+
+        sink << drv.outputs.size();
+        for (auto & j : drv.outputs)
+            sink << j.first << j.second.path << j.second.hashAlgo << j.second.hash;
+
+        sink << drv.inputDrvs.size();
+        for (auto & j : drv.inputDrvs)
+            sink << j.first << j.second;
+
+        sink << drv.inputSrcs;
+
+        StringPairs env;
+        for (auto & name : stepGraphEnvVars) {
+            auto j = drv.env.find(name);
+            if (j != drv.env.end()) env[j->first] = j->second;
+        }
+        sink << env.size();
+        for (auto & j : env)
+            sink << j.first << j.second;
+    }
+
+    /* Write atomically, so that the queue runner never sees a partial
+       graph. */
+    Path tmpFile = fileName + ".tmp";
+    writeFile(tmpFile, sink.s);
+    if (rename(tmpFile.c_str(), fileName.c_str()) == -1)
+        throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmpFile % fileName);
+}
+
+
+static inline StepGraph readStepGraph(const nix::Path & fileName)
+{
+    using namespace nix;
+
+    StepGraph graph;
+
+    string contents = readFile(fileName);
+    StringSource source(contents);
+
+    if (readInt(source) != stepGraphMagic)
+        throw Error(format("‘%1%’ is not a step graph") % fileName);
+
+    auto nrNodes = readLongLong(source);
+
+    for (unsigned long long n = 0; n < nrNodes; ++n) {
+        Path drvPath = readStorePath(source);
+        auto & drv(graph[drvPath]);
+        drv.platform = readString(source);
+
+        auto nrOutputs = readLongLong(source);
+        for (unsigned long long m = 0; m < nrOutputs; ++m) {
+            string name = readString(source);
+            auto & output(drv.outputs[name]);
+            output.path = readStorePath(source);
+            output.hashAlgo = readString(source);
+            output.hash = readString(source);
+        }
+
+        auto nrInputDrvs = readLongLong(source);
+        for (unsigned long long m = 0; m < nrInputDrvs; ++m) {
+            Path inputDrv = readStorePath(source);
+            drv.inputDrvs[inputDrv] = readStrings<StringSet>(source);
+        }
+
+        drv.inputSrcs = readStorePaths<PathSet>(source);
+
+        auto nrEnv = readLongLong(source);
+        for (unsigned long long m = 0; m < nrEnv; ++m) {
+            string name = readString(source);
+            drv.env[name] = readString(source);
+        }
+    }
+
+    return graph;
+}
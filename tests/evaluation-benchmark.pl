@@ -0,0 +1,204 @@
+use strict;
+use BSD::Resource;
+use JSON;
+use File::Temp;
+use Getopt::Long;
+use POSIX ();
+use Time::HiRes qw(time);
+
+# Measure the speed and memory use of hydra-eval-jobs on synthetic
+# release expressions, and write the results as a JSON report.
+
+my $nrJobs = 2000;
+my $nrAlts = 4;
+my $nrConstituents = 50;
+my $output;
+
+GetOptions(
+    "jobs=i" => \$nrJobs,
+    "alternatives=i" => \$nrAlts,
+    "constituents=i" => \$nrConstituents,
+    "output=s" => \$output,
+    ) or die "syntax: $0 [--jobs N] [--alternatives N] [--constituents N] [--output FILE]\n";
+
+my $tmpDir = File::Temp->newdir(CLEANUP => 1);
+
+my $mkDerivation = <<EOF;
+  mkJob = name: derivation {
+    inherit name;
+    system = builtins.currentSystem;
+    builder = "/bin/sh";
+    args = [ "-c" "echo \$name > \$out" ];
+  };
+EOF
+
+
+# A flat attribute set of jobs.
+sub flatExpr {
+    return <<EOF;
+let
+$mkDerivation
+in
+builtins.listToAttrs (map (n: { name = "job\${toString n}"; value = mkJob "job-\${toString n}"; })
+  (builtins.genList (n: n) $nrJobs))
+EOF
+}
+
+
+# Jobs in attribute sets nested three levels deep.
+sub nestedExpr {
+    my $fanout = int($nrJobs ** (1 / 3) + 0.5) || 1;
+    return <<EOF;
+let
+$mkDerivation
+  level = prefix: depth:
+    builtins.listToAttrs (map (n:
+      let name = "\${prefix}\${toString n}"; in
+      { name = "a\${toString n}";
+        value = if depth == 0 then mkJob name else level "\${name}-" (depth - 1);
+      }) (builtins.genList (n: n) $fanout));
+in
+level "job-" 2
+EOF
+}
+
+
+# Jobs that are functions of an argument that has several values,
+# each of which hydra-eval-jobs evaluates separately.
+sub argsExpr {
+    my $n = int($nrJobs / $nrAlts) || 1;
+    return <<EOF;
+let
+$mkDerivation
+in
+builtins.listToAttrs (map (n: { name = "job\${toString n}"; value = { variant }: mkJob "job-\${toString n}-\${toString variant}"; })
+  (builtins.genList (n: n) $n))
+EOF
+}
+
+
+# Aggregate jobs with many constituents each.
+sub aggregateExpr {
+    my $nrAggregates = int($nrJobs / $nrConstituents) || 1;
+    return <<EOF;
+let
+$mkDerivation
+  jobs = builtins.genList (n: mkJob "job-\${toString n}") $nrJobs;
+  aggregate = n: derivation {
+    name = "aggregate-\${toString n}";
+    system = builtins.currentSystem;
+    builder = "/bin/sh";
+    args = [ "-c" "touch \$out" ];
+    _hydraAggregate = true;
+    constituents = builtins.genList (m: builtins.elemAt jobs (builtins.mul n $nrConstituents + m)) $nrConstituents;
+  };
+in
+builtins.listToAttrs (map (n: { name = "aggregate\${toString n}"; value = aggregate n; })
+  (builtins.genList (n: n) $nrAggregates))
+EOF
+}
+
+
+# Run hydra-eval-jobs on the given expression. The peak resident set
+# size and CPU times come from getrusage(RUSAGE_CHILDREN) in an
+# intermediate process, of which hydra-eval-jobs is the only child.
+sub runBenchmark {
+    my ($name, $expr, @args) = @_;
+
+    my $exprFile = "$tmpDir/$name.nix";
+    open my $fh, ">", $exprFile or die "cannot write $exprFile: $!";
+    print $fh $expr;
+    close $fh;
+
+    my $stdoutFile = "$tmpDir/$name.out";
+    my $stderrFile = "$tmpDir/$name.err";
+    my $rusageFile = "$tmpDir/$name.rusage";
+
+    my $monitor = fork;
+    die "cannot fork: $!" unless defined $monitor;
+    if ($monitor == 0) {
+        my $startTime = time;
+        my $pid = fork;
+        POSIX::_exit(1) unless defined $pid;
+        if ($pid == 0) {
+            open STDOUT, ">", $stdoutFile or POSIX::_exit(1);
+            open STDERR, ">", $stderrFile or POSIX::_exit(1);
+            $ENV{NIX_SHOW_STATS} = "1";
+            exec "hydra-eval-jobs", "--dry-run", "-I", $tmpDir, $exprFile, @args;
+            POSIX::_exit(1);
+        }
+        waitpid($pid, 0);
+        my $status = $?;
+        my $wallTime = time - $startTime;
+        my ($userTime, $systemTime, $maxRSS) = getrusage(RUSAGE_CHILDREN);
+        open my $fh, ">", $rusageFile or POSIX::_exit(1);
+        print $fh "$status $wallTime $userTime $systemTime $maxRSS\n";
+        close $fh;
+        POSIX::_exit(0);
+    }
+
+    waitpid($monitor, 0);
+    die "cannot run hydra-eval-jobs on $name\n" if $? != 0;
+
+    open $fh, "<", $rusageFile or die "cannot read $rusageFile: $!";
+    my ($status, $wallTime, $userTime, $systemTime, $peakRSS) = split / /, <$fh>;
+    close $fh;
+    chomp $peakRSS;
+
+    my $stderr = do { local $/; open my $fh, "<", $stderrFile or die; <$fh> };
+    die "hydra-eval-jobs failed on $name:\n$stderr" if $status != 0;
+
+    # Count the jobs rather than decoding the JSON, because jobs that
+    # are evaluated for several argument values appear more than once.
+    my $jobs = 0;
+    open $fh, "<", $stdoutFile or die;
+    while (<$fh>) { $jobs++ if /"drvPath":/; }
+    close $fh;
+
+    # Parse the evaluator statistics, such as ‘number of thunks: 1234’.
+    my $stats = {};
+    foreach my $line (split /\n/, $stderr) {
+        next unless $line =~ /^\s+(.+?):\s+(\d+(?:\.\d+)?)/;
+        my $key = $1; my $value = $2;
+        $key =~ s/[^a-zA-Z0-9]+/_/g;
+        $stats->{lc $key} = $value + 0;
+    }
+
+    print STDERR "$name: $jobs jobs in ", sprintf("%.2f", $wallTime), " s, peak RSS $peakRSS KiB\n";
+
+    return
+        { jobs => $jobs
+        , wallTime => $wallTime + 0
+        , jobsPerSecond => $wallTime > 0 ? $jobs / $wallTime : undef
+        , userTime => $userTime + 0
+        , systemTime => $systemTime + 0
+        , peakRSS => $peakRSS * 1024
+        , stats => $stats
+        };
+}
+
+
+my $report =
+    { parameters =>
+        { jobs => $nrJobs
+        , alternatives => $nrAlts
+        , constituents => $nrConstituents
+        }
+    , benchmarks => {}
+    };
+
+$report->{benchmarks}->{flat} = runBenchmark("flat", flatExpr);
+$report->{benchmarks}->{nested} = runBenchmark("nested", nestedExpr);
+$report->{benchmarks}->{args} = runBenchmark("args", argsExpr,
+    map { ("--arg", "variant", $_) } (1..$nrAlts));
+$report->{benchmarks}->{aggregate} = runBenchmark("aggregate", aggregateExpr);
+
+my $json = JSON->new->pretty->canonical->encode($report);
+
+if (defined $output) {
+    open my $fh, ">", $output or die "cannot write $output: $!";
+    print $fh $json;
+    close $fh;
+} else {
+    print $json;
+}
@@ -0,0 +1,14 @@
+with import ./config.nix;
+{
+  fallback =
+    mkDerivation {
+      name = "replica-fallback";
+      builder = ./empty-dir-builder.sh;
+    };
+
+  cached_failure =
+    mkDerivation {
+      name = "replica-cached-failure";
+      builder = ./empty-dir-builder.sh;
+    };
+}
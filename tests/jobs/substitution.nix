@@ -0,0 +1,8 @@
+with import ./config.nix;
+{
+  substituted_input =
+    mkDerivation {
+      name = "substituted-input";
+      builder = ./empty-dir-builder.sh;
+    };
+}
@@ -0,0 +1,59 @@
+use strict;
+use Hydra::Schema;
+use Hydra::Model::DB;
+use Hydra::Helper::Nix;
+use File::Slurp;
+use Setup;
+
+# Test that hydra-queue-runner only uses the database replica
+# ($HYDRA_DBI_RO) when it is caught up with the primary, and falls
+# back to the primary otherwise.
+
+my $db = Hydra::Model::DB->new;
+
+use Test::Simple tests => 9;
+
+my $replicaDBI = "dbi:Pg:dbname=hydra-test-suite;port=6434";
+
+# A replica that cannot be reached: the queue runner should use the
+# primary.
+my $jobset = createBaseJobset("replica", "replica.nix");
+ok(evalSucceeds($jobset), "Evaluating jobs/replica.nix should exit with return code 0");
+ok(nrQueuedBuildsForJobset($jobset) == 2, "Evaluating jobs/replica.nix should result in 2 builds");
+
+my ($fallback) = queuedBuildsForJobset($jobset)->search({job => "fallback"});
+my ($cachedFailure) = queuedBuildsForJobset($jobset)->search({job => "cached_failure"});
+
+{
+    local $ENV{HYDRA_DBI_RO} = $replicaDBI;
+    ok(runBuild($fallback), "Build with an unreachable replica should exit with code 0");
+}
+$fallback = $db->resultset('Builds')->find($fallback->id);
+ok($fallback->finished == 1 && $fallback->buildstatus == 0, "Build with an unreachable replica should succeed");
+
+# Make a standby from a copy of the primary that is not connected to
+# the primary, so it never receives the writes made after the copy.
+system("pg_ctl -D postgres -w stop") == 0 or die;
+system("cp -a postgres postgres-replica") == 0 or die;
+system("pg_ctl -D postgres -o \"-F -p 6433 -h '' -c wal_level=hot_standby\" -w start") == 0 or die;
+write_file("postgres-replica/recovery.conf", "standby_mode = 'on'\nprimary_conninfo = 'port=6435'\n");
+ok(system("pg_ctl -D postgres-replica -o \"-F -p 6434 -h '' -c hot_standby=on\" -w start") == 0,
+   "Starting the disconnected replica should succeed");
+
+# Record a failed output path on the primary only. A queue runner
+# that reads FailedPaths from the stale replica wouldn't see it.
+$db = Hydra::Model::DB->new;
+my $outPath = $db->resultset('BuildOutputs')->find({build => $cachedFailure->id, name => "out"})->path;
+$db->storage->dbh->do("insert into FailedPaths values (?)", undef, $outPath);
+
+{
+    local $ENV{HYDRA_DBI_RO} = $replicaDBI;
+    ok(runBuild($cachedFailure), "Build of a cached failure should exit with code 0");
+}
+$cachedFailure = $db->resultset('Builds')->find($cachedFailure->id);
+ok($cachedFailure->finished == 1 && $cachedFailure->iscachedbuild == 1,
+   "Build of a path that failed after the replica's snapshot should be a cached failure");
+ok($cachedFailure->buildstatus == 1, "Cached failure should have buildstatus 1");
+
+ok(system("pg_ctl -D postgres-replica -w stop -m fast") == 0 && system("rm -rf postgres-replica") == 0,
+   "Stopping the replica should succeed");
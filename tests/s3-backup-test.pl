@@ -19,7 +19,7 @@ my $jobsetinput;
 
 $jobsetinput = $jobset->jobsetinputs->create({name => "jobs", type => "path"});
 $jobsetinput->jobsetinputalts->create({altnr => 0, value => getcwd . "/jobs"});
-system("hydra-evaluator " . $jobset->project->name . " " . $jobset->name);
+system("hydra-eval-jobset " . $jobset->project->name . " " . $jobset->name);
 
 my $successful_hash;
 foreach my $build ($jobset->builds->search({finished => 0})) {
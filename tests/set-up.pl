@@ -1,5 +1,6 @@
 use strict;
 system("initdb -D postgres") == 0 or die;
-system("pg_ctl -D postgres -o \"-F -p 6433 -h ''\" -w start") == 0 or die;
+# wal_level=hot_standby allows replica-tests.pl to make a standby.
+system("pg_ctl -D postgres -o \"-F -p 6433 -h '' -c wal_level=hot_standby\" -w start") == 0 or die;
 system("createdb -p 6433 hydra-test-suite") == 0 or die;
 system("hydra-init") == 0 or die;
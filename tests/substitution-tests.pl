@@ -0,0 +1,68 @@
+use strict;
+use Cwd;
+use Hydra::Schema;
+use Hydra::Model::DB;
+use Hydra::Helper::Nix;
+use File::Path;
+use File::Slurp;
+use Setup;
+
+# Test that a build machine with the ‘substitute=1’ option substitutes
+# missing inputs from its binary caches rather than having them
+# uploaded by the queue runner.
+#
+# The "remote" machine is the local nix-store --serve, reached through
+# a fake ssh, with its own Nix database: it shares the store directory
+# with the queue runner but has its own set of valid paths.
+
+my $db = Hydra::Model::DB->new;
+
+use Test::Simple tests => 8;
+
+my $jobset = createBaseJobset("substitution", "substitution.nix");
+ok(evalSucceeds($jobset), "Evaluating jobs/substitution.nix should exit with return code 0");
+ok(nrQueuedBuildsForJobset($jobset) == 1, "Evaluating jobs/substitution.nix should result in 1 build");
+
+my ($build) = queuedBuildsForJobset($jobset);
+
+# The inputs of the build (i.e. its builder), which the remote machine
+# doesn't have.
+my @inputs = grep { !/\.drv$/ } split /\n/, `nix-store --query --references ${\$build->drvpath}`;
+ok(scalar @inputs > 0, "The build should have inputs");
+
+# Put the inputs in a file-based binary cache.
+my $remoteDir = getcwd . "/nix/remote";
+my $cacheDir = getcwd . "/nix/substitution-cache";
+mkpath("$remoteDir/bin", "$remoteDir/etc/nix", "$remoteDir/var/nix", "$remoteDir/var/log/nix", $cacheDir);
+ok(system("nix-push", "--dest", $cacheDir, @inputs) == 0, "Pushing the inputs to the binary cache should succeed");
+
+write_file("$remoteDir/etc/nix/nix.conf", "binary-caches = file://$cacheDir\n");
+
+write_file("$remoteDir/bin/ssh", <<SCRIPT);
+#! /bin/sh
+while [ \$# -gt 0 ] && [ "\$1" != "--" ]; do shift; done
+shift
+export NIX_STATE_DIR=$remoteDir/var/nix
+export NIX_MANIFESTS_DIR=$remoteDir/var/nix/manifests
+export NIX_LOG_DIR=$remoteDir/var/log/nix
+export NIX_CONF_DIR=$remoteDir/etc/nix
+exec "\$@"
+SCRIPT
+chmod(0755, "$remoteDir/bin/ssh") or die;
+
+write_file("$remoteDir/machines", "remote " . $build->system . " - 1 1 - - - substitute=1\n");
+
+my ($res, $stdout, $stderr);
+{
+    local $ENV{PATH} = "$remoteDir/bin:$ENV{PATH}";
+    local $ENV{NIX_REMOTE_SYSTEMS} = "$remoteDir/machines";
+    ($res, $stdout, $stderr) = captureStdoutStderr(60, ("hydra-queue-runner", "-vvvv", "--build-one", $build->id));
+}
+ok($res == 0, "Building on the remote machine should exit with code 0");
+
+$build = $db->resultset('Builds')->find($build->id);
+ok($build->finished == 1 && $build->buildstatus == 0, "Building on the remote machine should succeed");
+
+ok($stderr =~ /‘remote’ substituted (\d+) of (\d+) missing paths/ && $1 == $2 && $1 > 0,
+   "The remote machine should substitute all missing inputs");
+ok($stderr !~ /sending \d+ missing paths/, "No inputs should be uploaded to the remote machine");